@@ -0,0 +1,87 @@
+/* Shared parts of the jfind benchmarks
+ *
+ * James Stanley 2012
+ */
+
+#include "bench.h"
+
+/* the globals that jfindd.c would otherwise define */
+int debug_mode = 0;
+int quiet_mode = 1;
+int unordered_mode = 0;
+const char *socket_path = SOCKET_PATH;
+
+static uint64_t random_state = 1;
+
+/* return the time in seconds from an arbitrary starting point */
+double now_secs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* start the random numbers from the given seed */
+void seed_random(uint64_t seed) {
+    /* xorshift gets stuck at 0 */
+    random_state = seed ? seed : 1;
+}
+
+/* return a random number between 0 and n-1 (xorshift64*); the same seed
+ * always gives the same numbers
+ */
+unsigned random_below(unsigned n) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+
+    return ((random_state * 2685821657736338717ull) >> 32) % n;
+}
+
+/* qsort() comparison function for doubles */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* sort the n doubles in x into ascending order */
+void sort_doubles(double *x, int n) {
+    qsort(x, n, sizeof(double), compare_doubles);
+}
+
+/* return the p'th percentile (0 to 100) of the n doubles in x, which must be
+ * sorted, or 0 if there are none
+ */
+double percentile(const double *x, int n, double p) {
+    if(!n)
+        return 0;
+
+    int i = (int)(p / 100 * n);
+    if(i >= n)
+        i = n - 1;
+
+    return x[i];
+}
+
+/* return the most memory the process has had resident, in kilobytes */
+long peak_rss_kb(void) {
+    struct rusage ru;
+
+    if(getrusage(RUSAGE_SELF, &ru) == -1)
+        return 0;
+
+    return ru.ru_maxrss;
+}
+
+/* print a result: its name, and its value printf()ed with fmt */
+void result(const char *name, const char *fmt, ...) {
+    va_list ap;
+
+    printf("%s ", name);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
@@ -0,0 +1,19 @@
+/* Shared parts of the jfind benchmarks
+ *
+ * The benchmarks are linked with everything in jfindd except main(), so that
+ * they can drive its internals directly. Results are printed one to a line,
+ * as a name and a value separated by a space, so that runs can be compared
+ * with nothing more than sort and join.
+ *
+ * James Stanley 2012
+ */
+
+#include "../daemon/jfindd.h"
+
+double now_secs(void);
+void seed_random(uint64_t seed);
+unsigned random_below(unsigned n);
+void sort_doubles(double *x, int n);
+double percentile(const double *x, int n, double p);
+long peak_rss_kb(void);
+void result(const char *name, const char *fmt, ...);
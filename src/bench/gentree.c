@@ -0,0 +1,176 @@
+/* Generate a synthetic tree of directories and empty files for the jfind
+ * benchmarks
+ *
+ * The same options and seed always give the same tree. Each directory down
+ * to the given depth gets between half and one and a half times the given
+ * number of subdirectories and of files, and each name is made of random
+ * characters with a length chosen evenly between the given minimum and
+ * maximum (a name that is already taken is skipped). Generating millions of
+ * entries is best done on tmpfs.
+ *
+ * usage: gentree [options] dir
+ *   -s SEED  seed for the random choices (default: 1)
+ *   -f N     subdirectories per directory, on average (default: 8)
+ *   -F N     files per directory, on average (default: 32)
+ *   -d N     levels of subdirectories below dir (default: 4)
+ *   -l N     shortest name (default: 4)
+ *   -L N     longest name (default: 16)
+ *   -n N     stop after N entries (default: no limit)
+ *
+ * James Stanley 2012
+ */
+
+#include "bench.h"
+
+static int fanout = 8;
+static int nfiles = 32;
+static int depth = 4;
+static int minname = 4;
+static int maxname = 16;
+static long limit = -1;
+
+static long ndirs;
+static long nfilesmade;
+
+/* return a count between half and one and a half times n */
+static int vary(int n) {
+    return n / 2 + random_below(n + 1);
+}
+
+/* append a random name to the path, which is len bytes long */
+static void random_name(char *path, int len) {
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789._-";
+
+    int n = minname + random_below(maxname - minname + 1);
+    int i;
+
+    path[len] = '/';
+    for(i = 0; i < n; i++)
+        path[len + 1 + i] = chars[random_below(sizeof(chars) - 1)];
+    path[len + 1 + n] = '\0';
+
+    /* names mustn't be "." or ".." */
+    if(strcmp(path + len + 1, ".") == 0 || strcmp(path + len + 1, "..") == 0)
+        path[len + 1] = 'x';
+}
+
+/* return 1 if no more entries should be made */
+static int full(void) {
+    return limit >= 0 && ndirs + nfilesmade >= limit;
+}
+
+/* fill the directory at path, which is len bytes long, and the levels below
+ * it
+ */
+static void generate(char *path, int len, int level) {
+    int n = vary(nfiles);
+    int i;
+
+    for(i = 0; i < n && !full(); i++) {
+        random_name(path, len);
+
+        /* a name that is already taken is skipped */
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if(fd == -1 && errno == EEXIST)
+            continue;
+        if(fd == -1) {
+            fprintf(stderr, "gentree: open: %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        close(fd);
+        nfilesmade++;
+    }
+
+    if(level == depth)
+        return;
+
+    n = vary(fanout);
+    for(i = 0; i < n && !full(); i++) {
+        random_name(path, len);
+
+        if(mkdir(path, 0755) == -1) {
+            if(errno == EEXIST)
+                continue;
+            fprintf(stderr, "gentree: mkdir: %s: %s\n", path,
+                    strerror(errno));
+            exit(1);
+        }
+        ndirs++;
+
+        generate(path, strlen(path), level + 1);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint64_t seed = 1;
+    int c;
+
+    while((c = getopt(argc, argv, "s:f:F:d:l:L:n:")) != -1) {
+        switch(c) {
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+
+            case 'f':
+                fanout = atoi(optarg);
+                break;
+
+            case 'F':
+                nfiles = atoi(optarg);
+                break;
+
+            case 'd':
+                depth = atoi(optarg);
+                break;
+
+            case 'l':
+                minname = atoi(optarg);
+                break;
+
+            case 'L':
+                maxname = atoi(optarg);
+                break;
+
+            case 'n':
+                limit = atol(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "usage: gentree [-s seed] [-f subdirs] "
+                        "[-F files] [-d depth] [-l minname] [-L maxname] "
+                        "[-n entries] dir\n");
+                return 1;
+        }
+    }
+
+    if(optind != argc - 1 || fanout < 0 || nfiles < 0 || depth < 0
+            || minname < 1 || maxname < minname || maxname > NAME_MAX) {
+        fprintf(stderr, "usage: gentree [-s seed] [-f subdirs] [-F files] "
+                "[-d depth] [-l minname] [-L maxname] [-n entries] dir\n");
+        return 1;
+    }
+
+    seed_random(seed);
+
+    char path[PATH_MAX];
+    if(strlen(argv[optind]) + (depth + 1) * (maxname + 1) >= PATH_MAX) {
+        fprintf(stderr, "gentree: paths would be too long\n");
+        return 1;
+    }
+    strcpy(path, argv[optind]);
+
+    if(mkdir(path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "gentree: mkdir: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    double start = now_secs();
+    generate(path, strlen(path), 0);
+
+    result("tree_dirs", "%ld", ndirs);
+    result("tree_files", "%ld", nfilesmade);
+    result("tree_entries", "%ld", ndirs + nfilesmade);
+    result("generate_seconds", "%.3f", now_secs() - start);
+
+    return 0;
+}
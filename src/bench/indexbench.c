@@ -0,0 +1,192 @@
+/* Time how long jfindd takes to index a tree, and count what it costs
+ *
+ * Each run starts with a new inotify instance and an empty tree, indexes the
+ * given paths with indexfrom() exactly as jfindd does at startup, and then
+ * throws everything away again. The times reported are for the indexing
+ * alone; the counts are of the first run.
+ *
+ * Calls are counted with the linker's --wrap (see INDEXBENCH_WRAP in the
+ * Makefile), so they are the calls jfindd itself makes: allocations inside
+ * libc (by opendir(), say) aren't counted, and one readdir() may be any
+ * number of getdents() syscalls, or none.
+ *
+ * usage: indexbench [-r runs] [-w watches] path...
+ *   -r N  index the paths N times (default: 5)
+ *   -w N  use at most N inotify watches, like jfindd -w
+ *
+ * James Stanley 2012
+ */
+
+#include <malloc.h>
+
+#include "bench.h"
+
+/* what is being counted; the reader thread allocates too, hence atomic
+ * increments
+ */
+enum {
+    C_MALLOC, C_CALLOC, C_REALLOC, C_STRDUP, C_ALLOC_BYTES,
+    C_LSTAT, C_STAT, C_STATFS, C_OPENDIR, C_READDIR, C_ADD_WATCH,
+    NCOUNTERS
+};
+
+static unsigned long counter[NCOUNTERS];
+static int counting;
+
+static void count(int c, unsigned long n) {
+    if(counting)
+        __atomic_fetch_add(&counter[c], n, __ATOMIC_RELAXED);
+}
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+char *__real_strdup(const char *s);
+int __real_lstat(const char *path, struct stat *buf);
+int __real_stat(const char *path, struct stat *buf);
+int __real_statfs(const char *path, struct statfs *buf);
+DIR *__real_opendir(const char *path);
+struct dirent *__real_readdir(DIR *dp);
+int __real_inotify_add_watch(int fd, const char *path, uint32_t mask);
+
+void *__wrap_malloc(size_t size) {
+    count(C_MALLOC, 1);
+    count(C_ALLOC_BYTES, size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    count(C_CALLOC, 1);
+    count(C_ALLOC_BYTES, n * size);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    count(C_REALLOC, 1);
+    count(C_ALLOC_BYTES, size);
+    return __real_realloc(p, size);
+}
+
+char *__wrap_strdup(const char *s) {
+    count(C_STRDUP, 1);
+    count(C_ALLOC_BYTES, strlen(s) + 1);
+    return __real_strdup(s);
+}
+
+int __wrap_lstat(const char *path, struct stat *buf) {
+    count(C_LSTAT, 1);
+    return __real_lstat(path, buf);
+}
+
+int __wrap_stat(const char *path, struct stat *buf) {
+    count(C_STAT, 1);
+    return __real_stat(path, buf);
+}
+
+int __wrap_statfs(const char *path, struct statfs *buf) {
+    count(C_STATFS, 1);
+    return __real_statfs(path, buf);
+}
+
+DIR *__wrap_opendir(const char *path) {
+    count(C_OPENDIR, 1);
+    return __real_opendir(path);
+}
+
+struct dirent *__wrap_readdir(DIR *dp) {
+    count(C_READDIR, 1);
+    return __real_readdir(dp);
+}
+
+int __wrap_inotify_add_watch(int fd, const char *path, uint32_t mask) {
+    count(C_ADD_WATCH, 1);
+    return __real_inotify_add_watch(fd, path, mask);
+}
+
+int main(int argc, char **argv) {
+    int runs = 5;
+    int c;
+
+    while((c = getopt(argc, argv, "r:w:")) != -1) {
+        switch(c) {
+            case 'r':
+                runs = atoi(optarg);
+                break;
+
+            case 'w':
+                max_watches = atoi(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "usage: indexbench [-r runs] [-w watches] "
+                        "path...\n");
+                return 1;
+        }
+    }
+
+    if(optind >= argc || runs < 1) {
+        fprintf(stderr, "usage: indexbench [-r runs] [-w watches] path...\n");
+        return 1;
+    }
+
+    double *times = malloc(runs * sizeof(double));
+    int nodes = 0, watches = 0, polled = 0;
+    size_t heap = 0;
+    int run, i;
+
+    for(run = 0; run < runs; run++) {
+        init_inotify();
+
+        struct mallinfo2 before = mallinfo2();
+        counting = !run;
+
+        double start = now_secs();
+        TreeNode *root = new_treenode("");
+        root->dir = new_dirinfo(root);
+        for(i = optind; i < argc; i++)
+            indexfrom(root, argv[i]);
+        times[run] = now_secs() - start;
+
+        counting = 0;
+
+        if(!run) {
+            heap = mallinfo2().uordblks - before.uordblks;
+            nodes = root->dir->nnodes;
+            watches = watch_count();
+            polled = npolled;
+        }
+
+        stop_inotify();
+        free_treenode(root);
+    }
+
+    double total = 0;
+    for(run = 0; run < runs; run++)
+        total += times[run];
+    sort_doubles(times, runs);
+
+    result("runs", "%d", runs);
+    result("index_seconds_min", "%.4f", times[0]);
+    result("index_seconds_median", "%.4f", percentile(times, runs, 50));
+    result("index_seconds_mean", "%.4f", total / runs);
+    result("nodes", "%d", nodes);
+    result("nodes_per_sec", "%.0f", nodes / percentile(times, runs, 50));
+    result("watches", "%d", watches);
+    result("polled", "%d", polled);
+    result("calls_lstat", "%lu", counter[C_LSTAT]);
+    result("calls_stat", "%lu", counter[C_STAT]);
+    result("calls_statfs", "%lu", counter[C_STATFS]);
+    result("calls_opendir", "%lu", counter[C_OPENDIR]);
+    result("calls_readdir", "%lu", counter[C_READDIR]);
+    result("calls_inotify_add_watch", "%lu", counter[C_ADD_WATCH]);
+    result("allocs_malloc", "%lu", counter[C_MALLOC]);
+    result("allocs_calloc", "%lu", counter[C_CALLOC]);
+    result("allocs_realloc", "%lu", counter[C_REALLOC]);
+    result("allocs_strdup", "%lu", counter[C_STRDUP]);
+    result("allocs_bytes", "%lu", counter[C_ALLOC_BYTES]);
+    result("heap_bytes", "%zu", heap);
+    result("bytes_per_node", "%.1f", nodes ? (double)heap / nodes : 0);
+    result("peak_rss_kb", "%ld", peak_rss_kb());
+
+    return 0;
+}
@@ -0,0 +1,535 @@
+/* Time queries against an index, directly and over the socket
+ *
+ * The paths given are indexed as jfindd would index them, and then a mix of
+ * queries is run twice: first straight through new_search() and
+ * search_step(), one at a time, to time the search itself; and then through
+ * a copy of the daemon's main loop, forked off to serve the same tree, by
+ * clients connected to its socket with the line protocol, each sending its
+ * next query as soon as the last one is answered. The socket queries go
+ * through the daemon's cache like any others, so a term that comes up more
+ * than once may be answered from it.
+ *
+ * The standard mix is made of terms taken from the names of paths picked at
+ * random from the tree, in equal numbers of each class:
+ *  common: 2 characters of a name, which match a lot of paths
+ *  rare:   4 characters of a name, which match a few
+ *  long:   a whole name
+ *  path:   a name with the name of the directory it is in, and the '/'
+ *          between them
+ * With -q, the queries are read from a file instead, one to a line as a
+ * class name and then the term after a space; lines starting with '#' are
+ * ignored. The file is gone through as many times as it takes to make up the
+ * number of queries.
+ *
+ * Latencies are reported for each class and for all of them, as name and
+ * value lines like the other benchmarks.
+ *
+ * usage: querybench [options] path...
+ *   -c N     clients connected to the socket at once (default: 4)
+ *   -j N     worker threads, like jfindd -j (default: one per CPU)
+ *   -n N     queries to run each way (default: 400)
+ *   -q FILE  read the queries from FILE instead of making the standard mix
+ *   -s SEED  seed for picking the standard mix (default: 1)
+ *   -u       allow results in any order, like jfindd -u
+ *
+ * James Stanley 2012
+ */
+
+#include <sys/wait.h>
+
+#include "bench.h"
+
+/* paths picked from the tree to make the standard mix from */
+#define NSAMPLES 1024
+
+#define MAX_CLASSES 16
+
+typedef struct Query {
+    int class;
+    char *term;
+    int nresults;/* found by the direct search */
+} Query;
+
+/* a client connected to the socket, and the queries it sends */
+typedef struct Client {
+    pthread_t thread;
+    int first;/* it sends queries first, first + nclients, ... */
+    int failed;
+} Client;
+
+static TreeNode *root;
+
+static char *classname[MAX_CLASSES];
+static int nclasses;
+
+static Query *query;
+static int nqueries = 400;
+static double *latency;/* in seconds, for each query */
+
+static int nclients = 4;
+static char sockpath[108];
+
+/* return the number of the class with the given name, adding it if it is
+ * new, or -1 if there are too many
+ */
+static int class_named(const char *name) {
+    int i;
+
+    for(i = 0; i < nclasses; i++)
+        if(strcmp(classname[i], name) == 0)
+            return i;
+
+    if(nclasses == MAX_CLASSES)
+        return -1;
+
+    classname[nclasses] = strdup(name);
+    return nclasses++;
+}
+
+/* return a copy of len bytes of s, starting at a random place */
+static char *random_substring(const char *s, int len) {
+    int n = strlen(s);
+    if(len > n)
+        len = n;
+
+    return strndup(s + random_below(n - len + 1), len);
+}
+
+/* make the standard mix of queries from paths picked from the tree */
+static void standard_mix(void) {
+    static char *sample[NSAMPLES];
+    int nsamples = 0;
+    long seen = 0;
+
+    /* pick paths with reservoir sampling, so that each is as likely as any
+     * other
+     */
+    Traversal *tr = new_traversal(root, "/");
+    char *path;
+    while(traversal_next(tr, &path)) {
+        char *name = strrchr(path, '/');
+        if(!name || !name[1])
+            continue;
+
+        seen++;
+        long i = seen <= NSAMPLES ? seen - 1 : random_below(seen);
+        if(i < NSAMPLES) {
+            free(sample[i]);
+            sample[i] = strdup(path);
+        }
+    }
+    free_traversal(tr);
+
+    nsamples = seen < NSAMPLES ? seen : NSAMPLES;
+    if(!nsamples) {
+        fprintf(stderr, "querybench: nothing was indexed\n");
+        exit(1);
+    }
+
+    int common = class_named("common");
+    int rare = class_named("rare");
+    int whole = class_named("long");
+    int dir = class_named("path");
+
+    int i;
+    for(i = 0; i < nqueries; i++) {
+        char *p = sample[random_below(nsamples)];
+        char *name = strrchr(p, '/') + 1;
+
+        Query *q = query + i;
+        q->class = i % nclasses;
+        if(q->class == common) {
+            q->term = random_substring(name, 2);
+        } else if(q->class == rare) {
+            q->term = random_substring(name, 4);
+        } else if(q->class == whole) {
+            q->term = strdup(name);
+        } else if(q->class == dir) {
+            /* back up to the start of the directory's name */
+            char *start = name - 1;
+            while(start > p && start[-1] != '/')
+                start--;
+            q->term = strdup(start);
+        }
+    }
+
+    for(i = 0; i < nsamples; i++)
+        free(sample[i]);
+}
+
+/* read the queries from the file */
+static void read_queries(const char *file) {
+    FILE *fp;
+
+    if(!(fp = fopen(file, "r"))) {
+        fprintf(stderr, "querybench: %s: %s\n", file, strerror(errno));
+        exit(1);
+    }
+
+    Query *q = NULL;
+    int n = 0, nallocd = 0;
+    char line[PATH_MAX + 64];
+    while(fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if(line[0] == '#' || !line[0])
+            continue;
+
+        char *term = strchr(line, ' ');
+        if(!term || !term[1]) {
+            fprintf(stderr, "querybench: %s: no term in \"%s\"\n", file, line);
+            exit(1);
+        }
+        *term++ = '\0';
+
+        if(n == nallocd) {
+            nallocd = nallocd ? nallocd * 2 : 64;
+            q = realloc(q, nallocd * sizeof(Query));
+        }
+        if((q[n].class = class_named(line)) == -1) {
+            fprintf(stderr, "querybench: %s: more than %d classes\n", file,
+                    MAX_CLASSES);
+            exit(1);
+        }
+        q[n++].term = strdup(term);
+    }
+    fclose(fp);
+
+    if(!n) {
+        fprintf(stderr, "querybench: %s: no queries\n", file);
+        exit(1);
+    }
+
+    int i;
+    for(i = 0; i < nqueries; i++) {
+        query[i].class = q[i % n].class;
+        query[i].term = strdup(q[i % n].term);
+    }
+
+    for(i = 0; i < n; i++)
+        free(q[i].term);
+    free(q);
+}
+
+/* wait for a worker to finish a slice, and take back the parts that are
+ * finished
+ */
+static void wait_for_workers(void) {
+    struct pollfd pfd = { worker_fd(), POLLIN, 0 };
+    SearchPart *p;
+
+    if(poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        perror("poll");
+        exit(1);
+    }
+
+    while((p = finished_work())) {
+        p->busy = 0;
+        p->search->nbusy--;
+    }
+}
+
+/* run each query through the search engine in turn, throwing the results
+ * away, and return how long it took altogether
+ */
+static double run_direct(int unordered) {
+    OutBuffer out;
+    int i;
+
+    memset(&out, 0, sizeof(out));
+
+    double start = now_secs();
+    for(i = 0; i < nqueries; i++) {
+        double t = now_secs();
+
+        Search *s = new_search(root, "/", query[i].term, unordered, '\n');
+        if(s) {
+            while(!search_step(s, &out)) {
+                out.start = out.nbytes = 0;
+                if(nworkers && !search_runnable(s, &out))
+                    wait_for_workers();
+            }
+            query[i].nresults = search_results(s);
+            free_search(s);
+        }
+        out.start = out.nbytes = 0;
+
+        latency[i] = now_secs() - t;
+    }
+
+    free(out.buf);
+
+    return now_secs() - start;
+}
+
+/* return a new connection to the socket, or -1 if there is a problem */
+static int connect_socket(void) {
+    struct sockaddr_un remote;
+    int fd;
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+
+    remote.sun_family = AF_UNIX;
+    strcpy(remote.sun_path, sockpath);
+    if(connect(fd, (struct sockaddr *)&remote,
+                strlen(remote.sun_path) + sizeof(remote.sun_family)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* send each of the client's queries in turn, timing how long each takes to
+ * be answered; the answer is the results and then an empty line
+ */
+static void *run_client(void *arg) {
+    Client *c = arg;
+    char buf[65536];
+    int fd;
+
+    if((fd = connect_socket()) == -1) {
+        perror("querybench: connect");
+        c->failed = 1;
+        return NULL;
+    }
+
+    int i;
+    for(i = c->first; i < nqueries; i += nclients) {
+        double t = now_secs();
+
+        char *line = strallocat(query[i].term, "\n", NULL);
+        int len = strlen(line), n = 0, w;
+        while(n < len && (w = write(fd, line + n, len - n)) > 0)
+            n += w;
+        free(line);
+
+        /* the answer ends at a newline at the start of a line */
+        int linestart = 1;
+        int done = 0;
+        while(!done && (n = read(fd, buf, sizeof(buf))) > 0) {
+            int j;
+            for(j = 0; j < n && !done; j++) {
+                if(buf[j] == '\n')
+                    done = linestart;
+                linestart = buf[j] == '\n';
+            }
+        }
+        if(!done) {
+            fprintf(stderr, "querybench: lost the connection\n");
+            c->failed = 1;
+            break;
+        }
+
+        latency[i] = now_secs() - t;
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+/* connect the clients to the socket and run the queries through them, and
+ * return how long it took, or -1 if there was a problem
+ */
+static double run_socket(void) {
+    Client *c = malloc(nclients * sizeof(Client));
+    int failed = 0;
+    int i;
+
+    double start = now_secs();
+    for(i = 0; i < nclients; i++) {
+        c[i].first = i;
+        c[i].failed = 0;
+        if(pthread_create(&c[i].thread, NULL, run_client, c + i)) {
+            fprintf(stderr, "querybench: can't start a client\n");
+            exit(1);
+        }
+    }
+    for(i = 0; i < nclients; i++) {
+        pthread_join(c[i].thread, NULL);
+        failed |= c[i].failed;
+    }
+    double total = now_secs() - start;
+
+    free(c);
+
+    return failed ? -1 : total;
+}
+
+/* fork off a copy of the daemon's main loop to serve the tree on sockpath,
+ * and return its pid once it is accepting connections
+ */
+static pid_t start_server(int threads) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if(pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+
+    if(!pid) {
+        /* the tree's watches belong to the parent's inotify instance, which
+         * is gone; this one stays empty, since nothing is watched
+         */
+        init_inotify();
+        init_workers(threads);
+        start_journal();
+        run(root, sockpath);
+        exit(1);
+    }
+
+    /* wait for it to start listening */
+    int i, fd = -1;
+    for(i = 0; i < 1000 && (fd = connect_socket()) == -1; i++)
+        usleep(10000);
+    if(fd == -1) {
+        fprintf(stderr, "querybench: the server didn't start\n");
+        kill(pid, SIGTERM);
+        exit(1);
+    }
+    close(fd);
+
+    return pid;
+}
+
+/* print the latencies of the queries in each class, and of all of them,
+ * prefixed with "mode"
+ */
+static void report(const char *mode, double total) {
+    double *x = malloc(nqueries * sizeof(double));
+    char name[128];
+    int class, i, n;
+
+    for(class = -1; class < nclasses; class++) {
+        n = 0;
+        for(i = 0; i < nqueries; i++)
+            if(class == -1 || query[i].class == class)
+                x[n++] = latency[i];
+        sort_doubles(x, n);
+
+        const char *cname = class == -1 ? "all" : classname[class];
+        snprintf(name, sizeof(name), "%s_%s_us_p50", mode, cname);
+        result(name, "%.1f", percentile(x, n, 50) * 1e6);
+        snprintf(name, sizeof(name), "%s_%s_us_p99", mode, cname);
+        result(name, "%.1f", percentile(x, n, 99) * 1e6);
+        snprintf(name, sizeof(name), "%s_%s_us_p999", mode, cname);
+        result(name, "%.1f", percentile(x, n, 99.9) * 1e6);
+    }
+
+    snprintf(name, sizeof(name), "%s_qps", mode);
+    result(name, "%.1f", total > 0 ? nqueries / total : 0);
+
+    free(x);
+}
+
+int main(int argc, char **argv) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *file = NULL;
+    uint64_t seed = 1;
+    int unordered = 0;
+    int c;
+
+    while((c = getopt(argc, argv, "c:j:n:q:s:u")) != -1) {
+        switch(c) {
+            case 'c':
+                nclients = atoi(optarg);
+                break;
+
+            case 'j':
+                threads = atoi(optarg);
+                break;
+
+            case 'n':
+                nqueries = atoi(optarg);
+                break;
+
+            case 'q':
+                file = optarg;
+                break;
+
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+
+            case 'u':
+                unordered = 1;
+                break;
+
+            default:
+                fprintf(stderr, "usage: querybench [-c clients] [-j threads] "
+                        "[-n queries] [-q file] [-s seed] [-u] path...\n");
+                return 1;
+        }
+    }
+
+    if(optind >= argc || nclients < 1 || nclients > MAX_USER_CLIENTS
+            || threads < 0 || nqueries < 1) {
+        fprintf(stderr, "usage: querybench [-c clients] [-j threads] "
+                "[-n queries] [-q file] [-s seed] [-u] path...\n");
+        return 1;
+    }
+
+    seed_random(seed);
+    unordered_mode = unordered;
+
+    /* index the tree */
+    init_inotify();
+    root = new_treenode("");
+    root->dir = new_dirinfo(root);
+    int i;
+    for(i = optind; i < argc; i++)
+        indexfrom(root, argv[i]);
+    stop_inotify();
+
+    query = calloc(nqueries, sizeof(Query));
+    latency = malloc(nqueries * sizeof(double));
+    if(file)
+        read_queries(file);
+    else
+        standard_mix();
+
+    snprintf(sockpath, sizeof(sockpath), "/tmp/jfind-querybench.%d.sock",
+            (int)getpid());
+    pid_t server = start_server(threads);
+
+    init_workers(threads);
+
+    result("query_nodes", "%d", root->dir->nnodes);
+    result("queries", "%d", nqueries);
+    result("threads", "%d", threads);
+    result("clients", "%d", nclients);
+
+    /* how much each class of query matches, to tell mixes apart */
+    double total = run_direct(unordered);
+    int class;
+    for(class = 0; class < nclasses; class++) {
+        long nresults = 0;
+        int n = 0;
+        for(i = 0; i < nqueries; i++) {
+            if(query[i].class == class) {
+                nresults += query[i].nresults;
+                n++;
+            }
+        }
+
+        char name[128];
+        snprintf(name, sizeof(name), "%s_results_mean", classname[class]);
+        result(name, "%.1f", n ? (double)nresults / n : 0);
+    }
+    report("direct", total);
+
+    total = run_socket();
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(sockpath);
+
+    if(total < 0)
+        return 1;
+    report("socket", total);
+
+    result("query_peak_rss_kb", "%ld", peak_rss_kb());
+
+    return 0;
+}
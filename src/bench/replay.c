@@ -0,0 +1,329 @@
+/* Replay an inotify capture recorded with jfindd -r
+ *
+ * The events in the capture are fed through the same coalescing and
+ * tree-mutation handlers that jfindd uses, as fast as they will go, with no
+ * filesystem and no inotify; the rest of the capture builds the tree they
+ * apply to and keeps it in step with what jfindd found by indexing. Only the
+ * handling of the events is timed.
+ *
+ * usage: replay [-d] [-p] capture
+ *   -d  print each event as it is replayed, like jfindd -d
+ *   -p  print the paths in the tree at the end instead of the results, to
+ *       compare with what jfindd had
+ *
+ * James Stanley 2012
+ */
+
+#include "bench.h"
+
+static TreeNode *root;
+
+/* the directories that the paths in JF_CAPTURE_PATHS records go under: the
+ * one the records started from, and those above the latest path, deepest
+ * last; each one's path is the first stacklen[i] bytes of dirpath
+ */
+static TreeNode **stack;
+static int *stacklen;
+static int depth;
+static int stackallocd;
+static char dirpath[PATH_MAX * 2];
+
+/* the time taken to handle each JF_CAPTURE_EVENTS record, in seconds */
+static double *batchtime;
+static int nbatches;
+static int nbatchallocd;
+
+/* start the stack of directories from t, whose path is given */
+static void start_paths(TreeNode *t, const char *path) {
+    if(!stackallocd) {
+        stackallocd = 64;
+        stack = malloc(stackallocd * sizeof(TreeNode *));
+        stacklen = malloc(stackallocd * sizeof(int));
+    }
+
+    snprintf(dirpath, sizeof(dirpath), "%s", path);
+    stack[0] = t;
+    stacklen[0] = strlen(dirpath);
+    depth = 1;
+}
+
+/* add the path, which is below the directory at the bottom of the stack, to
+ * the tree
+ */
+static void add_path(char *path) {
+    int len = strlen(path);
+
+    /* find the directory it is in */
+    while(depth > 1 && (len <= stacklen[depth - 1]
+                || strncmp(path, dirpath, stacklen[depth - 1]) != 0))
+        depth--;
+
+    TreeNode *parent = stack[depth - 1];
+    char *name = path + stacklen[depth - 1];
+    int dir = len > 0 && path[len - 1] == '/';
+    if(dir)
+        path[len - 1] = '\0';
+
+    if(!*name || strchr(name, '/') || !parent->dir) {
+        fprintf(stderr, "replay: %s: not in the tree\n", path);
+        return;
+    }
+
+    TreeNode *t = new_treenode(name);
+    if(dir)
+        t->dir = new_dirinfo(t);
+    t->indexed = 1;
+    add_child(parent, t);
+
+    if(dir) {
+        path[len - 1] = '/';
+        if(depth == stackallocd) {
+            stackallocd *= 2;
+            stack = realloc(stack, stackallocd * sizeof(TreeNode *));
+            stacklen = realloc(stacklen, stackallocd * sizeof(int));
+        }
+        snprintf(dirpath, sizeof(dirpath), "%s", path);
+        stack[depth] = t;
+        stacklen[depth++] = len;
+    }
+}
+
+/* forget the tree and start a new one */
+static void reset_tree(void) {
+    if(root) {
+        forget_moves();
+        free_treenode(root);
+    }
+
+    root = new_treenode("");
+    root->dir = new_dirinfo(root);
+    root->indexed = 1;
+
+    start_paths(root, "/");
+}
+
+/* replace everything below the directory at path, ready for the paths that
+ * follow
+ */
+static void reindexed(char *path) {
+    TreeNode *t = lookup_treenode(root, path, 1);
+
+    if(!t->dir) {
+        fprintf(stderr, "replay: %s: not a directory\n", path);
+        return;
+    }
+
+    /* removing children can replace the array, so the one being walked is
+     * kept until it has been walked
+     */
+    unsigned long gen = hold_treenodes();
+    ChildArray *a = t->dir->children;
+    int i;
+    for(i = 0; a && i < a->nchilds; i++) {
+        TreeNode *child = a->child[i];
+        if(child) {
+            remove_treenode(child);
+            free_treenode(child);
+        }
+    }
+    release_treenodes(gen);
+    t->indexed = 1;
+
+    start_paths(t, path);
+}
+
+/* point wd at the directory at path */
+static void watch(int wd, char *path) {
+    TreeNode *t = lookup_treenode(root, path, 1);
+
+    if(!t->dir) {
+        fprintf(stderr, "replay: %s: not a directory\n", path);
+        return;
+    }
+
+    if(t->dir->wd != -1)
+        remove_wd(t->dir->wd);
+    remove_wd(wd);
+
+    t->dir->wd = wd;
+    set_treenode_for_wd(wd, t);
+}
+
+/* handle the n bytes of events in buf, timing how long it takes */
+static void events(const char *buf, int n) {
+    if(nbatches == nbatchallocd) {
+        nbatchallocd = nbatchallocd ? nbatchallocd * 2 : 1024;
+        batchtime = realloc(batchtime, nbatchallocd * sizeof(double));
+    }
+
+    double start = now_secs();
+    if(replay_events(root, buf, n) == -1)
+        fprintf(stderr, "replay: inotify event queue overflowed here\n");
+    batchtime[nbatches++] = now_secs() - start;
+}
+
+/* print the paths in the tree */
+static void print_tree(void) {
+    Traversal *tr = new_traversal(root, "/");
+    char *path;
+
+    while(traversal_next(tr, &path))
+        printf("%s\n", path);
+
+    free_traversal(tr);
+}
+
+/* return the FNV-1a hash of every path in the tree, in tree order */
+static uint64_t tree_checksum(void) {
+    Traversal *tr = new_traversal(root, "/");
+    uint64_t h = 14695981039346656037ull;
+    char *path;
+
+    while(traversal_next(tr, &path)) {
+        char *p;
+        for(p = path; ; p++) {
+            h = (h ^ (unsigned char)*p) * 1099511628211ull;
+            if(!*p)
+                break;
+        }
+    }
+
+    free_traversal(tr);
+
+    return h;
+}
+
+int main(int argc, char **argv) {
+    int print = 0;
+    int c;
+
+    while((c = getopt(argc, argv, "dp")) != -1) {
+        switch(c) {
+            case 'd':
+                debug_mode = 1;
+                break;
+
+            case 'p':
+                print = 1;
+                break;
+
+            default:
+                fprintf(stderr, "usage: replay [-d] [-p] capture\n");
+                return 1;
+        }
+    }
+
+    if(optind != argc - 1) {
+        fprintf(stderr, "usage: replay [-d] [-p] capture\n");
+        return 1;
+    }
+
+    const char *file = argv[optind];
+    FILE *fp;
+    if(!(fp = fopen(file, "r"))) {
+        fprintf(stderr, "replay: %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+
+    CaptureHeader h;
+    if(fread(&h, sizeof(h), 1, fp) != 1
+            || memcmp(h.magic, JF_CAPTURE_MAGIC, sizeof(h.magic)) != 0
+            || h.version != JF_CAPTURE_VERSION) {
+        fprintf(stderr, "replay: %s: not a capture this can replay\n", file);
+        return 1;
+    }
+
+    replay_mode = 1;
+    start_journal();
+    reset_tree();
+
+    char *buf = NULL;
+    uint32_t nallocd = 0;
+    CaptureRecord r;
+    while(fread(&r, sizeof(r), 1, fp) == 1) {
+        if(r.size + 1 > nallocd) {
+            nallocd = r.size + 1;
+            buf = realloc(buf, nallocd);
+        }
+        if(r.size && fread(buf, r.size, 1, fp) != 1) {
+            fprintf(stderr, "replay: %s: truncated record\n", file);
+            break;
+        }
+        buf[r.size] = '\0';
+
+        uint32_t id = 0;
+        if(r.size >= sizeof(id))
+            memcpy(&id, buf, sizeof(id));
+
+        char *p;
+        switch(r.type) {
+            case JF_CAPTURE_RESET:
+                reset_tree();
+                break;
+
+            case JF_CAPTURE_INDEXED:
+                reindexed(buf);
+                break;
+
+            case JF_CAPTURE_PATHS:
+                for(p = buf; p < buf + r.size; p += strlen(p) + 1)
+                    add_path(p);
+                break;
+
+            case JF_CAPTURE_WATCH:
+                watch(id, buf + sizeof(id));
+                break;
+
+            case JF_CAPTURE_UNWATCH:
+                remove_wd(id);
+                break;
+
+            case JF_CAPTURE_EVENTS:
+                events(buf, r.size);
+                break;
+
+            case JF_CAPTURE_EXPIRE:
+                expire_move_for_cookie(id);
+                break;
+
+            default:
+                fprintf(stderr, "replay: %s: unknown record type %u\n", file,
+                        r.type);
+                break;
+        }
+    }
+
+    fclose(fp);
+    free(buf);
+
+    if(print) {
+        print_tree();
+        return 0;
+    }
+
+    double total = 0;
+    int i;
+    for(i = 0; i < nbatches; i++)
+        total += batchtime[i];
+    sort_doubles(batchtime, nbatches);
+
+    result("events", "%lu", inotify_events);
+    result("coalesced", "%lu", inotify_coalesced);
+    result("batches", "%d", nbatches);
+    result("seconds", "%.6f", total);
+    result("events_per_sec", "%.0f", total ? inotify_events / total : 0);
+    result("batch_us_p50", "%.1f", percentile(batchtime, nbatches, 50) * 1e6);
+    result("batch_us_p99", "%.1f", percentile(batchtime, nbatches, 99) * 1e6);
+    result("batch_us_p999", "%.1f",
+            percentile(batchtime, nbatches, 99.9) * 1e6);
+    result("batch_us_max", "%.1f",
+            nbatches ? batchtime[nbatches - 1] * 1e6 : 0);
+    result("moves_paired", "%lu", moves_paired);
+    result("moves_expired", "%lu", moves_expired);
+    result("moves_pending", "%d", nmoves);
+    result("nodes", "%d", root->dir->nnodes);
+    result("checksum", "%016llx", (unsigned long long)tree_checksum());
+    result("peak_rss_kb", "%ld", peak_rss_kb());
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+/* Inotify event captures for jfind
+ *
+ * With -r, jfindd records the inotify events it handles to a capture file,
+ * along with enough of the tree to make sense of them, so that they can be
+ * replayed later without the filesystem they came from (see
+ * src/bench/replay.c).
+ *
+ * The file is a CaptureHeader followed by records, each a CaptureRecord
+ * followed by "size" bytes:
+ *  JF_CAPTURE_RESET:   nothing; forget the tree and the watches, and start a
+ *                      new tree (jfindd starts again with a new tree after an
+ *                      inotify queue overflow)
+ *  JF_CAPTURE_INDEXED: the path of a directory that has just been indexed,
+ *                      or read again after polling found it had changed,
+ *                      terminated by a nul byte; what was below it is
+ *                      replaced
+ *  JF_CAPTURE_PATHS:   paths below the directory given by the last
+ *                      JF_CAPTURE_RESET or JF_CAPTURE_INDEXED, in tree
+ *                      order, each terminated by a nul byte; directories end
+ *                      in '/'
+ *  JF_CAPTURE_WATCH:   a uint32_t wd followed by the path of the directory
+ *                      it now watches, terminated by a nul byte
+ *  JF_CAPTURE_UNWATCH: a uint32_t wd that no longer watches anything
+ *  JF_CAPTURE_EVENTS:  struct inotify_events exactly as read from the kernel,
+ *                      as one batch handled by handle_inotify_events()
+ *  JF_CAPTURE_EXPIRE:  a uint32_t cookie whose IN_MOVED_TO didn't come in
+ *                      time
+ * Everything is in the byte order of the machine.
+ *
+ * James Stanley 2012
+ */
+
+#define JF_CAPTURE_MAGIC   "jfcap\0\0\0"
+#define JF_CAPTURE_VERSION 1
+
+/* record types */
+#define JF_CAPTURE_RESET   1
+#define JF_CAPTURE_INDEXED 2
+#define JF_CAPTURE_PATHS   3
+#define JF_CAPTURE_WATCH   4
+#define JF_CAPTURE_UNWATCH 5
+#define JF_CAPTURE_EVENTS  6
+#define JF_CAPTURE_EXPIRE  7
+
+typedef struct CaptureHeader {
+    char magic[8];/* JF_CAPTURE_MAGIC */
+    uint32_t version;/* JF_CAPTURE_VERSION */
+    uint32_t unused;
+} CaptureHeader;
+
+typedef struct CaptureRecord {
+    uint32_t type;/* JF_CAPTURE_* */
+    uint32_t size;/* bytes after the CaptureRecord */
+    uint64_t time;/* nanoseconds since recording started */
+} CaptureRecord;
@@ -3,22 +3,358 @@
  * James Stanley 2012
  */
 
+#define _GNU_SOURCE
+
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <arpa/inet.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #include "../config.h"
+#include "../protocol.h"
+#include "../snapshot.h"
+
+/* read a big-endian uint16 from p */
+static int get16(const char *p) {
+    uint16_t n;
+    memcpy(&n, p, 2);
+    return ntohs(n);
+}
+
+/* read a big-endian uint32 from p */
+static uint32_t get32(const char *p) {
+    uint32_t n;
+    memcpy(&n, p, 4);
+    return ntohl(n);
+}
+
+/* read a big-endian uint64 from p */
+static uint64_t get64(const char *p) {
+    return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+/* write n to p as a big-endian uint16 */
+static void put16(char *p, int n) {
+    uint16_t v = htons(n);
+    memcpy(p, &v, 2);
+}
+
+/* write n to p as a big-endian uint32 */
+static void put32(char *p, uint32_t n) {
+    uint32_t v = htonl(n);
+    memcpy(p, &v, 4);
+}
+
+/* write n to p as a big-endian uint64 */
+static void put64(char *p, uint64_t n) {
+    put32(p, n >> 32);
+    put32(p + 4, n);
+}
+
+/* write a frame to the daemon */
+static void write_frame(FILE *fp, int type, uint32_t id, const char *payload,
+        int length) {
+    char header[JF_HEADER_SIZE];
+
+    put32(header, length);
+    put16(header + 4, type);
+    put16(header + 6, 0);
+    put32(header + 8, id);
+
+    fwrite(header, JF_HEADER_SIZE, 1, fp);
+    fwrite(payload, length, 1, fp);
+}
+
+/* write a frame to the daemon, passing it the file descriptor passfd along
+ * with it
+ */
+static void write_frame_fd(FILE *fp, int type, uint32_t id,
+        const char *payload, int length, int passfd) {
+    char *frame = malloc(JF_HEADER_SIZE + length);
+
+    put32(frame, length);
+    put16(frame + 4, type);
+    put16(frame + 6, 0);
+    put32(frame + 8, id);
+    memcpy(frame + JF_HEADER_SIZE, payload, length);
+
+    /* the fd goes with the first byte sent, so nothing buffered must go
+     * before it
+     */
+    fflush(fp);
+
+    struct iovec iov = { frame, JF_HEADER_SIZE + length };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+
+    ssize_t n;
+    while((n = sendmsg(fileno(fp), &msg, 0)) == -1 && errno == EINTR);
+
+    /* errors are noticed when the reply doesn't come */
+    if(n > 0 && n < JF_HEADER_SIZE + length)
+        fwrite(frame + n, JF_HEADER_SIZE + length - n, 1, fp);
+
+    free(frame);
+}
+
+/* copy the whole of the file to stdout, without passing it through our
+ * memory if the kernel can do it
+ */
+static int copy_to_stdout(int fd) {
+    struct stat st;
+    off_t off = 0;
+
+    fflush(stdout);
+
+    if(fstat(fd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+
+    while(off < st.st_size) {
+        if(sendfile(1, fd, &off, st.st_size - off) > 0)
+            continue;
+        if(errno == EINTR)
+            continue;
+        if(errno != EINVAL && errno != ENOSYS) {
+            /* a reader that has stopped reading doesn't need telling */
+            if(errno != EPIPE)
+                perror("sendfile");
+            return -1;
+        }
+
+        /* stdout can't be sent to, so copy it the usual way */
+        char *buf = malloc(CLIENT_BUFSIZE);
+        ssize_t n;
+        while((n = pread(fd, buf, CLIENT_BUFSIZE, off)) > 0) {
+            if(fwrite(buf, n, 1, stdout) != 1)
+                break;
+            off += n;
+        }
+        free(buf);
+        fflush(stdout);
+        if(off < st.st_size) {
+            perror("jfind: copying results");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* append an option to the query payload in buf, which is *len bytes long */
+static void add_option(char *buf, int *len, int opt, const void *value,
+        int vlen) {
+    put16(buf + *len, opt);
+    put16(buf + *len + 2, vlen);
+    memcpy(buf + *len + 4, value, vlen);
+    *len += 4 + vlen;
+}
+
+/* read a frame from the daemon into header and a newly-allocated, nul-
+ * terminated *payload
+ * return 0 on success and -1 at end of file
+ */
+static int read_frame(FILE *fp, char *header, char **payload) {
+    int c;
+
+    /* the daemon refuses clients it can't serve with a line of text, which
+     * can't be a frame because frames start with a 0 byte
+     */
+    if((c = fgetc(fp)) == EOF)
+        return -1;
+    if(c != 0) {
+        char buf[256];
+        ungetc(c, fp);
+        if(fgets(buf, sizeof(buf), fp))
+            fprintf(stderr, "jfind: %s", buf);
+        exit(1);
+    }
+
+    *header = 0;
+    if(fread(header + 1, JF_HEADER_SIZE - 1, 1, fp) != 1)
+        return -1;
+
+    uint32_t length = get32(header);
+    if(length > JF_MAX_FRAME) {
+        fprintf(stderr, "jfind: bad frame from daemon\n");
+        exit(1);
+    }
+
+    *payload = malloc(length + 1);
+    if(length && fread(*payload, length, 1, fp) != 1) {
+        free(*payload);
+        return -1;
+    }
+    (*payload)[length] = '\0';
+
+    return 0;
+}
+
+/* print the paths in the daemon's snapshot of the index that contain term,
+ * each followed by sep
+ * return 0 on success and 1 on error
+ */
+static int search_snapshot(const char *term, char sep) {
+    int fd;
+    if((fd = open(SNAPSHOT_PATH, O_RDONLY)) == -1) {
+        fprintf(stderr, "jfind: %s: %s\n", SNAPSHOT_PATH, strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return 1;
+    }
+
+    char *map = NULL;
+    if(st.st_size >= sizeof(SnapshotHeader))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    SnapshotHeader *h = (SnapshotHeader *)map;
+    if(!map || map == MAP_FAILED || memcmp(h->magic, JF_SNAPSHOT_MAGIC, 8)
+            || h->version != JF_SNAPSHOT_VERSION
+            || h->size != st.st_size - sizeof(SnapshotHeader)) {
+        fprintf(stderr, "jfind: %s: not a usable snapshot\n", SNAPSHOT_PATH);
+        return 1;
+    }
+
+    /* find each occurrence of the term, and print the path it is in; the
+     * term can't contain a nul, so it can't span two paths
+     */
+    const char *p = map + sizeof(SnapshotHeader);
+    const char *end = p + h->size;
+    const char *match;
+    size_t len = strlen(term);
+    while(p < end && (match = memmem(p, end - p, term, len))) {
+        const char *start = memrchr(p, '\0', match - p);
+        start = start ? start + 1 : p;
+        p = memchr(match, '\0', end - match);
+        if(!p)
+            break;
+
+        fwrite(start, p - start, 1, stdout);
+        putchar(sep);
+        p++;
+    }
+
+    munmap(map, st.st_size);
+
+    return 0;
+}
 
 int main(int argc, char **argv) {
-    if(argc != 2) {
-        fprintf(stderr, "usage: jfind search-term\n");
+    int print0 = 0;
+    int unordered = 0;
+    int follow = 0;
+    int changes = 0;
+    int snapshot = 0;
+    int bulk = 0;
+    int stats = 0;
+    uint64_t since = 0;
+    char *end;
+    int c;
+
+    while((c = getopt(argc, argv, "0bc:fmsu")) != -1) {
+        switch(c) {
+            case '0':
+                print0 = 1;
+                break;
+
+            case 'b':
+                bulk = 1;
+                break;
+
+            case 'c':
+                changes = 1;
+                since = strtoull(optarg, &end, 10);
+                if(!*optarg || *end) {
+                    fprintf(stderr, "jfind: bad generation: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'f':
+                follow = 1;
+                break;
+
+            case 'm':
+                snapshot = 1;
+                break;
+
+            case 's':
+                stats = 1;
+                break;
+
+            case 'u':
+                unordered = 1;
+                break;
+
+            default:
+                return 1;
+        }
+    }
+
+    if(optind != argc - !(changes || stats)
+            || (snapshot && (changes || follow))
+            || (bulk && (changes || follow || snapshot))
+            || (stats && (changes || follow || snapshot || bulk))) {
+        fprintf(stderr, "usage: jfind [-0fu] search-term\n"
+                        "       jfind [-0u] -b search-term\n"
+                        "       jfind [-0] -m search-term\n"
+                        "       jfind [-0] -c generation\n"
+                        "       jfind -s\n"
+                        "  -0  terminate results with nul instead of newline\n"
+                        "  -b  get all of the results at once through a "
+                        "memory file (faster for\n"
+                        "      lots of results)\n"
+                        "  -c  print the current generation, then the changes "
+                        "since the given one\n"
+                        "      (exit status 2 if they are no longer known)\n"
+                        "  -f  keep printing changes as +path and -path\n"
+                        "  -m  search the daemon's latest snapshot of the "
+                        "index (see jfindd -m)\n"
+                        "  -s  print the daemon's statistics, in the "
+                        "Prometheus text format\n"
+                        "  -u  allow results in any order\n");
         return 1;
     }
 
+    const char *term = changes || stats ? "" : argv[optind];
+    if(strlen(term) > 65535) {
+        fprintf(stderr, "jfind: search term too long\n");
+        return 1;
+    }
+
+    if(snapshot)
+        return search_snapshot(term, print0 ? '\0' : '\n');
+
     int fd;
     if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
         perror("socket");
@@ -42,17 +378,160 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    fprintf(fp, "%s\n", argv[1]);
+    /* results come and go in big chunks, except on a terminal */
+    setvbuf(fp, NULL, _IOFBF, CLIENT_BUFSIZE);
+    if(!isatty(1))
+        setvbuf(stdout, NULL, _IOFBF, CLIENT_BUFSIZE);
 
-    char buf[4096];
-    while(fgets(buf, 4096, fp)) {
-        if(*buf == '\n')
-            break;
+    /* the daemon writes bulk results straight into a file in memory */
+    int bulkfd = -1;
+    if(bulk && (bulkfd = memfd_create("jfind", MFD_CLOEXEC)) == -1) {
+        perror("memfd_create");
+        return 1;
+    }
+
+    /* the daemon may refuse us before reading the query, in which case we
+     * still want to read the reason
+     */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* say hello and send the query */
+    char version[4];
+    put32(version, JF_VERSION);
+    write_frame(fp, JF_MSG_HELLO, 0, version, 4);
+
+    if(changes) {
+        char gen[8];
+        put64(gen, since);
+        write_frame(fp, JF_MSG_CHANGES, 1, gen, 8);
+    } else if(stats) {
+        write_frame(fp, JF_MSG_STATS, 1, NULL, 0);
+    } else {
+        char *query = malloc(strlen(term) + 16);
+        int qlen = 0;
+        add_option(query, &qlen, JF_OPT_TERM, term, strlen(term));
+        char one = 1;
+        if(unordered)
+            add_option(query, &qlen, JF_OPT_UNORDERED, &one, 1);
+        if(follow)
+            add_option(query, &qlen, JF_OPT_SUBSCRIBE, &one, 1);
+        if(bulk) {
+            char sep = print0 ? '\0' : '\n';
+            add_option(query, &qlen, JF_OPT_BULK, &sep, 1);
+            write_frame_fd(fp, JF_MSG_QUERY, 1, query, qlen, bulkfd);
+        } else {
+            write_frame(fp, JF_MSG_QUERY, 1, query, qlen);
+        }
+        free(query);
+    }
 
-        fputs(buf, stdout);
+    fflush(fp);
+
+    /* print results until the query is done */
+    char header[JF_HEADER_SIZE];
+    char *payload;
+    int status = -1;
+    while(status == -1 && read_frame(fp, header, &payload) == 0) {
+        uint32_t length = get32(header);
+        int type = get16(header + 4);
+        int fstatus = get16(header + 6);
+        char *p;
+
+        switch(type) {
+            case JF_MSG_HELLO:
+                if(fstatus != JF_STATUS_OK) {
+                    fprintf(stderr, "jfind: daemon speaks protocol version "
+                            "%u, not %d\n", length >= 4 ? get32(payload) : 0,
+                            JF_VERSION);
+                    status = 1;
+                }
+                break;
+
+            case JF_MSG_RESULTS:
+            case JF_MSG_DELTA:
+                /* results are nul-terminated paths, which can be written
+                 * out all at once
+                 */
+                if(!follow) {
+                    if(!print0)
+                        for(p = payload; (p = memchr(p, '\0',
+                                        payload + length - p)); p++)
+                            *p = '\n';
+                    fwrite(payload, length, 1, stdout);
+                    break;
+                }
+
+                /* deltas are the same with a + or - in front; when
+                 * following, the initial results are printed as additions
+                 */
+                for(p = payload; p < payload + length; p += strlen(p) + 1) {
+                    if(follow && type == JF_MSG_RESULTS)
+                        putchar('+');
+                    fputs(p, stdout);
+                    putchar(print0 ? '\0' : '\n');
+                }
+                if(type == JF_MSG_DELTA)
+                    fflush(stdout);
+                break;
+
+            case JF_MSG_SYNCED:
+                fflush(stdout);
+                break;
+
+            case JF_MSG_GENERATION:
+                if(changes && length == 8)
+                    printf("g\t%llu%c", (unsigned long long)get64(payload),
+                            print0 ? '\0' : '\n');
+                break;
+
+            case JF_MSG_CHANGES:
+                /* each change is printed as its type and path(s) separated
+                 * by tabs
+                 */
+                for(p = payload; p + 9 < payload + length;
+                        p += strlen(p) + 1) {
+                    int ctype = p[8];
+                    p += 9;
+                    if(ctype == JF_CHANGE_CREATE)
+                        printf("c\t%s", p);
+                    else if(ctype == JF_CHANGE_DELETE)
+                        printf("d\t%s", p);
+                    else {
+                        printf("r\t%s\t", p);
+                        p += strlen(p) + 1;
+                        fputs(p, stdout);
+                    }
+                    putchar(print0 ? '\0' : '\n');
+                }
+                break;
+
+            case JF_MSG_STATS:
+                fwrite(payload, length, 1, stdout);
+                break;
+
+            case JF_MSG_DONE:
+                if(fstatus == JF_STATUS_RESYNC) {
+                    fprintf(stderr, "jfind: resync required\n");
+                    status = 2;
+                } else if(fstatus != JF_STATUS_OK) {
+                    fprintf(stderr, "jfind: %s\n",
+                            length >= 4 ? payload + 4 : "error");
+                    status = 1;
+                } else {
+                    status = bulk && copy_to_stdout(bulkfd) == -1;
+                }
+                break;
+        }
+
+        free(payload);
+    }
+
+    if(status == -1) {
+        fprintf(stderr, "jfind: connection to daemon lost\n");
+        status = 1;
     }
 
     fclose(fp);
 
-    return 0;
+    return status;
 }
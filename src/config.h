@@ -3,3 +3,108 @@
  * James Stanley 2012 */
 
 #define SOCKET_PATH "/tmp/jfind.sock"
+
+/* bytes of search results to queue for a client (or for each part of a
+ * search) before pausing the search until the client reads some of them
+ */
+#define OUTBUF_SIZE 262144
+
+/* nodes a search visits before the daemon goes back to handle inotify events
+ * and other clients
+ */
+#define SEARCH_SLICE 4096
+
+/* with more than one worker thread, big searches are split into about this
+ * many parts per worker
+ */
+#define SEARCH_PARTS_PER_WORKER 4
+
+/* queries a binary-protocol client can have in flight at once; no more of its
+ * messages are read until one of them has finished
+ */
+#define MAX_REQUESTS 16
+
+/* clients one user can have connected, and queries they can have in
+ * progress between them; more queries are read as others finish
+ */
+#define MAX_USER_CLIENTS 256
+#define MAX_USER_REQUESTS 64
+
+/* searches of at least EXPENSIVE_NODES nodes are expensive, and only
+ * MAX_EXPENSIVE of them run at once; the others wait their turn, with the
+ * users running the fewest going first
+ */
+#define EXPENSIVE_NODES 65536
+#define MAX_EXPENSIVE 4
+
+/* searches are ended after running for this many seconds (not counting time
+ * spent waiting for the client to read the results), or after visiting this
+ * many nodes (0 for no limit)
+ */
+#define QUERY_TIME_LIMIT 60
+#define QUERY_NODE_LIMIT 0
+
+/* bytes of inotify events that are read and coalesced at a time */
+#define INOTIFY_BUFSIZE (256 * 1024)
+
+/* bytes of inotify events the reader thread can hold while the main thread is
+ * busy, before leaving them in the kernel's queue (a power of two)
+ */
+#define INOTIFY_RING_SIZE (16 * 1024 * 1024)
+
+/* most bytes of paths in one record of an inotify capture (see capture.h) */
+#define CAPTURE_PATHS_SIZE (1024 * 1024)
+
+/* milliseconds to wait for the IN_MOVED_TO that goes with an IN_MOVED_FROM
+ * before deciding the node was moved out of the tree
+ */
+#define MOVE_TIMEOUT 200
+
+/* percentage of the user's inotify watches (max_user_watches) jfindd uses
+ * unless told otherwise; directories beyond that are polled
+ */
+#define WATCH_SHARE 90
+
+/* seconds between checks of a polled directory: this starts at the minimum,
+ * and doubles each time it hasn't changed up to the maximum
+ */
+#define POLL_MIN_INTERVAL 5
+#define POLL_MAX_INTERVAL 300
+
+/* polled directories checked at a time before going back to other work */
+#define POLL_BATCH 256
+
+/* checks in a row that find changes before a polled directory is given a
+ * watch in place of the one that has gone longest without an event
+ */
+#define POLL_PROMOTE_AFTER 3
+
+/* bytes of output that can be waiting for a subscribed client before its
+ * subscription is dropped
+ */
+#define SUBSCRIBE_BACKLOG (16 * 1024 * 1024)
+
+/* bytes of search results that are kept to answer repeated queries, and the
+ * most that are kept for any one query
+ */
+#define CACHE_SIZE (64 * 1024 * 1024)
+#define CACHE_ENTRY_SIZE (4 * 1024 * 1024)
+
+/* the most bytes of results that are kept from a query in a refinement
+ * session, for the next query in the session to filter
+ */
+#define REFINE_ENTRY_SIZE (16 * 1024 * 1024)
+
+/* changes to the tree that are remembered for clients asking what has changed
+ * since a generation; older generations get "resync required"
+ */
+#define JOURNAL_SIZE 65536
+
+/* bytes of buffer jfind uses for reading results and writing them out */
+#define CLIENT_BUFSIZE (1024 * 1024)
+
+/* where jfindd -m publishes snapshots of the index, and the fewest seconds
+ * between them
+ */
+#define SNAPSHOT_PATH "/dev/shm/jfind.snapshot"
+#define SNAPSHOT_INTERVAL 5
@@ -0,0 +1,225 @@
+/* Cache the results of searches for jfindd
+ *
+ * Every directory remembers the tree_generation at which anything below it
+ * last changed, and at which it was put in its place, so a cached result is
+ * still right as long as neither has moved on since its search started for
+ * the directory it searched under (and the second for the directories above
+ * that). The least recently used results are dropped to keep the cache
+ * within CACHE_SIZE bytes.
+ *
+ * James Stanley 2012
+ */
+
+#include "jfindd.h"
+
+unsigned long cache_hits;
+unsigned long cache_misses;
+
+static CacheEntry *cache_hash;/* in order of use, least recent first */
+long cache_bytes;/* bytes of results in the cache */
+
+/* make the key for a query, which is its mode followed by its path and term;
+ * returns the length of the key, which is not nul-terminated
+ * you must free the returned *key
+ */
+static int cache_key(char **key, const char *path, const char *term,
+        int unordered, char sep) {
+    int pathlen = strlen(path);
+    int termlen = strlen(term);
+
+    *key = malloc(pathlen + termlen + 3);
+    (*key)[0] = unordered;
+    (*key)[1] = sep;
+    memcpy(*key + 2, path, pathlen + 1);
+    memcpy(*key + 3 + pathlen, term, termlen);
+
+    return pathlen + termlen + 3;
+}
+
+/* return 1 if nothing has changed under the entry's path since its search
+ * started, and 0 otherwise
+ */
+static int cache_valid(CacheEntry *e, TreeNode *root) {
+    TreeNode *t = lookup_treenode(root, e->path, 0);
+
+    if(!t)
+        return 0;
+
+    /* a file's changes show up on its directory */
+    if(!t->dir)
+        t = t->parent;
+
+    if(t->dir->changed > e->gen)
+        return 0;
+
+    /* the path could now lead somewhere else */
+    for(; t; t = t->parent)
+        if(t->dir->added > e->gen)
+            return 0;
+
+    return 1;
+}
+
+/* remove the entry from the cache and free it */
+static void remove_cacheentry(CacheEntry *e) {
+    HASH_DEL(cache_hash, e);
+    cache_bytes -= e->results.nallocd;
+    free_cacheentry(e);
+}
+
+/* return the cached results of the query if they are still right, or NULL
+ * if there aren't any
+ */
+CacheEntry *cache_lookup(TreeNode *root, const char *path, const char *term,
+        int unordered, char sep) {
+    CacheEntry *e;
+    char *key;
+    int keylen = cache_key(&key, path, term, unordered, sep);
+
+    HASH_FIND(hh, cache_hash, key, keylen, e);
+    free(key);
+
+    if(e && !cache_valid(e, root)) {
+        remove_cacheentry(e);
+        e = NULL;
+    }
+
+    if(e) {
+        /* move it to the most recently used end */
+        HASH_DEL(cache_hash, e);
+        HASH_ADD_KEYPTR(hh, cache_hash, e->key, e->keylen, e);
+        cache_hits++;
+        PROBE1(query_cached, term);
+    } else {
+        cache_misses++;
+    }
+
+    if(debug_mode)
+        printf("cache %s: %s (%lu hits, %lu misses, %ld bytes)\n",
+                e ? "hit" : "miss", term, cache_hits, cache_misses,
+                cache_bytes);
+
+    return e;
+}
+
+/* allocate and return a new CacheEntry for the query */
+static CacheEntry *new_cacheentry(const char *path, const char *term,
+        int unordered, char sep) {
+    CacheEntry *e = malloc(sizeof(CacheEntry));
+
+    memset(e, 0, sizeof(CacheEntry));
+    e->keylen = cache_key(&e->key, path, term, unordered, sep);
+    e->path = strdup(path);
+
+    return e;
+}
+
+/* put the entry in the cache, replacing any other for the same query */
+static void cache_insert(CacheEntry *e) {
+    CacheEntry *old;
+
+    /* trim the buffer to fit, since it will be kept a while */
+    e->results.buf = realloc(e->results.buf, e->results.nbytes + 1);
+    e->results.nallocd = e->results.nbytes + 1;
+
+    /* replace a stale entry for the same query */
+    HASH_FIND(hh, cache_hash, e->key, e->keylen, old);
+    if(old)
+        remove_cacheentry(old);
+
+    /* make room by dropping the least recently used */
+    while(cache_hash && cache_bytes + e->results.nallocd > CACHE_SIZE)
+        remove_cacheentry(cache_hash);
+
+    HASH_ADD_KEYPTR(hh, cache_hash, e->key, e->keylen, e);
+    cache_bytes += e->results.nallocd;
+}
+
+/* return the results of the query found by filtering the cached results of
+ * the same query for oldterm, which term must contain, or NULL if they
+ * aren't cached or are out of date; the results are cached in turn
+ */
+CacheEntry *cache_refine(TreeNode *root, const char *path,
+        const char *oldterm, const char *term, int unordered, char sep) {
+    CacheEntry *old;
+    char *key;
+    int keylen = cache_key(&key, path, oldterm, unordered, sep);
+
+    HASH_FIND(hh, cache_hash, key, keylen, old);
+    free(key);
+
+    if(!old)
+        return NULL;
+    if(!cache_valid(old, root)) {
+        remove_cacheentry(old);
+        return NULL;
+    }
+
+    /* the results are still right as long as the old ones are */
+    CacheEntry *e = new_cacheentry(path, term, unordered, sep);
+    e->gen = old->gen;
+
+    /* anything that contains term also contains oldterm, so only the old
+     * results can match
+     */
+    char *p = old->results.buf;
+    char *end = p + old->results.nbytes;
+    int len = strlen(term);
+    while(p < end) {
+        char *next = memchr(p, sep, end - p) + 1;
+        if(memmem(p, next - p - 1, term, len)) {
+            append_outbuffer(&e->results, p, next - p);
+            e->count++;
+        }
+        p = next;
+    }
+
+    cache_insert(e);
+    cache_hits++;
+    PROBE1(query_cached, term);
+
+    if(debug_mode)
+        printf("cache refine: %s -> %s (%u of %u results)\n", oldterm, term,
+                e->count, old->count);
+
+    return e;
+}
+
+/* have the results of the search, which has just been started, stored in
+ * the cache once it finishes, unless there are more than limit bytes of them
+ */
+void cache_fill(Search *s, const char *path, int limit) {
+    CacheEntry *e = new_cacheentry(path, s->term, s->unordered, s->sep);
+
+    e->gen = tree_generation;
+    e->limit = limit;
+
+    s->fill = e;
+}
+
+/* put the results collected for the finished search in the cache */
+void cache_store(Search *s) {
+    CacheEntry *e = s->fill;
+
+    s->fill = NULL;
+    e->count = search_results(s);
+
+    cache_insert(e);
+}
+
+/* free the given CacheEntry, which must not be in the cache */
+void free_cacheentry(CacheEntry *e) {
+    if(!e)
+        return;
+
+    free(e->results.buf);
+    free(e->path);
+    free(e->key);
+    free(e);
+}
+
+/* forget all cached results */
+void clear_cache(void) {
+    while(cache_hash)
+        remove_cacheentry(cache_hash);
+}
@@ -0,0 +1,220 @@
+/* Record inotify event captures for jfindd
+ *
+ * See src/capture.h for the file format. Writing a record that fails stops
+ * the recording with a warning; jfindd carries on without it.
+ *
+ * James Stanley 2012
+ */
+
+#include "jfindd.h"
+
+const char *record_path;/* the capture to record to, if any */
+int replay_mode;/* 1 if events come from a capture instead of the kernel */
+
+static FILE *fp;
+static struct timespec started;
+
+static char *paths;/* paths waiting to go in a JF_CAPTURE_PATHS record */
+static int npathbytes;
+
+/* give up on recording, printing a warning */
+static void record_error(const char *what) {
+    fprintf(stderr, "warning: %s: %s: %s; no longer recording\n", what,
+            record_path, strerror(errno));
+    fclose(fp);
+    fp = NULL;
+}
+
+/* write a record of the given type, whose contents are the "alen" bytes of a
+ * followed by the "blen" bytes of b
+ */
+static void write_record(int type, const void *a, uint32_t alen,
+        const void *b, uint32_t blen) {
+    struct timespec now;
+    CaptureRecord r;
+
+    if(!fp)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    r.type = type;
+    r.size = alen + blen;
+    r.time = (now.tv_sec - started.tv_sec) * 1000000000ull
+        + now.tv_nsec - started.tv_nsec;
+
+    if(fwrite(&r, sizeof(r), 1, fp) != 1
+            || (alen && fwrite(a, alen, 1, fp) != 1)
+            || (blen && fwrite(b, blen, 1, fp) != 1))
+        record_error("fwrite");
+}
+
+/* flush what has been recorded to the file, so that the capture is complete
+ * up to here if jfindd is killed
+ */
+static void flush_capture(void) {
+    if(fp && fflush(fp) == EOF)
+        record_error("fflush");
+}
+
+/* write out the paths that are waiting */
+static void flush_paths(void) {
+    write_record(JF_CAPTURE_PATHS, paths, npathbytes, NULL, 0);
+    npathbytes = 0;
+}
+
+/* add the path, which is len bytes long, to the next JF_CAPTURE_PATHS
+ * record
+ */
+static void record_path_bytes(const char *path, int len) {
+    if(npathbytes + len + 1 > CAPTURE_PATHS_SIZE)
+        flush_paths();
+
+    memcpy(paths + npathbytes, path, len + 1);
+    npathbytes += len + 1;
+}
+
+/* call func for everything below the directory t, whose path is in the
+ * buffer at *path and is len bytes long, with the path of each in the buffer
+ */
+static void walk_tree(TreeNode *t, char **path, int *nallocd, int len,
+        void (*func)(TreeNode *, const char *, int)) {
+    ChildArray *a = t->dir->children;
+    int i;
+    for(i = 0; a && i < a->nchilds; i++) {
+        TreeNode *child = a->child[i];
+        if(!child)
+            continue;
+
+        int namelen = strlen(child->name);
+        if(len + namelen + 2 >= *nallocd) {
+            *nallocd = (len + namelen + 2) * 2;
+            *path = realloc(*path, *nallocd);
+        }
+
+        strcpy(*path + len, child->name);
+        if(child->dir)
+            strcpy(*path + len + namelen, "/");
+
+        func(child, *path, len + namelen + !!child->dir);
+        if(child->dir)
+            walk_tree(child, path, nallocd, len + namelen + 1, func);
+    }
+}
+
+/* walk_tree() function to record a path */
+static void _record_path(TreeNode *t, const char *path, int len) {
+    record_path_bytes(path, len);
+}
+
+/* walk_tree() function to record a watch */
+static void _record_watch(TreeNode *t, const char *path, int len) {
+    if(t->dir && t->dir->wd != -1) {
+        uint32_t wd = t->dir->wd;
+        write_record(JF_CAPTURE_WATCH, &wd, sizeof(wd), path, len + 1);
+    }
+}
+
+/* record everything below the directory t, whose path is given, and then
+ * the watches from t down
+ */
+static void record_tree(TreeNode *t, const char *tpath) {
+    int nallocd = strlen(tpath) + 256;
+    char *path = malloc(nallocd);
+
+    strcpy(path, tpath);
+    walk_tree(t, &path, &nallocd, strlen(tpath), _record_path);
+    flush_paths();
+
+    _record_watch(t, tpath, strlen(tpath));
+    walk_tree(t, &path, &nallocd, strlen(tpath), _record_watch);
+
+    free(path);
+}
+
+/* start recording to record_path, beginning with the tree as it is now; this
+ * is called again each time jfindd starts afresh with a new tree
+ */
+void start_recording(TreeNode *root) {
+    if(!record_path)
+        return;
+
+    if(!fp && !paths) {
+        if(!(fp = fopen(record_path, "w"))) {
+            fprintf(stderr, "warning: fopen: %s: %s; not recording\n",
+                    record_path, strerror(errno));
+            return;
+        }
+
+        CaptureHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, JF_CAPTURE_MAGIC, sizeof(h.magic));
+        h.version = JF_CAPTURE_VERSION;
+        if(fwrite(&h, sizeof(h), 1, fp) != 1)
+            record_error("fwrite");
+
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        paths = malloc(CAPTURE_PATHS_SIZE);
+    }
+
+    if(!fp)
+        return;
+
+    write_record(JF_CAPTURE_RESET, NULL, 0, NULL, 0);
+    record_tree(root, "/");
+    flush_capture();
+}
+
+/* record what is below the directory, which has just been indexed or read
+ * again
+ */
+void record_indexed(TreeNode *t) {
+    if(!fp)
+        return;
+
+    char *path = treenode_name(t);
+    write_record(JF_CAPTURE_INDEXED, path, strlen(path) + 1, NULL, 0);
+    record_tree(t, path);
+    free(path);
+    flush_capture();
+}
+
+/* record that the directory is now watched with wd */
+void record_watch(int wd, TreeNode *t) {
+    if(!fp)
+        return;
+
+    uint32_t w = wd;
+    char *path = treenode_name(t);
+    write_record(JF_CAPTURE_WATCH, &w, sizeof(w), path, strlen(path) + 1);
+    free(path);
+    flush_capture();
+}
+
+/* record that wd no longer watches anything */
+void record_unwatch(int wd) {
+    if(!fp)
+        return;
+
+    uint32_t w = wd;
+    write_record(JF_CAPTURE_UNWATCH, &w, sizeof(w), NULL, 0);
+    flush_capture();
+}
+
+/* record that the move with the given cookie has expired */
+void record_expire(int cookie) {
+    if(!fp)
+        return;
+
+    uint32_t c = cookie;
+    write_record(JF_CAPTURE_EXPIRE, &c, sizeof(c), NULL, 0);
+    flush_capture();
+}
+
+/* record the n bytes of events in buf, which are about to be handled */
+void record_events(const char *buf, int n) {
+    if(!fp)
+        return;
+
+    write_record(JF_CAPTURE_EVENTS, buf, n, NULL, 0);
+    flush_capture();
+}
@@ -7,6 +7,8 @@
 
 static DirInfo *wd_hash;
 
+unsigned long ndirinfos;/* DirInfos allocated */
+
 /* allocate and return a DirInfo for the given TreeNode */
 DirInfo *new_dirinfo(TreeNode *t) {
     DirInfo *d = malloc(sizeof(DirInfo));
@@ -14,6 +16,9 @@ DirInfo *new_dirinfo(TreeNode *t) {
     memset(d, 0, sizeof(DirInfo));
     d->t = t;
     d->wd = -1;
+    d->changed = d->added = ++tree_generation;
+
+    ndirinfos++;
 
     return d;
 }
@@ -38,8 +43,29 @@ DirInfo *dirinfo_for_wd(int wd) {
 void remove_wd(int wd) {
     DirInfo *d = dirinfo_for_wd(wd);
 
-    if(d)
+    if(d) {
         HASH_DEL(wd_hash, d);
+        d->wd = -1;
+        record_unwatch(wd);
+    }
+}
+
+/* return the number of watches in use */
+int watch_count(void) {
+    return HASH_COUNT(wd_hash);
+}
+
+/* return the watched directory that has gone longest without an event, or
+ * NULL if there are none
+ */
+DirInfo *coldest_watch(void) {
+    DirInfo *d, *tmp, *cold = NULL;
+
+    HASH_ITER(hh, wd_hash, d, tmp)
+        if(!cold || d->active < cold->active)
+            cold = d;
+
+    return cold;
 }
 
 /* free the given DirInfo (and all of the child TreeNodes) */
@@ -48,13 +74,17 @@ void free_dirinfo(DirInfo *d) {
         return;
 
     int i;
-    for(i = 0; i < d->nchilds; i++)
-        free_treenode(d->child[i]);
-    free(d->child);
+    for(i = 0; d->children && i < d->children->nchilds; i++)
+        free_treenode(d->children->child[i]);
+    if(d->children)
+        childarray_bytes -= childarray_size(d->children->nallocd);
+    free(d->children);
 
     if(d->wd != -1)
         HASH_DEL(wd_hash, d);
+    unpoll_directory(d);
 
     d->t->dir = NULL;
     free(d);
+    ndirinfos--;
 }
@@ -6,7 +6,11 @@
 #include "jfindd.h"
 
 static void _indexfs(TreeNode *root, TreeNode *node, char *path);
-static int _traverse(TreeNode *t, char *path, TraversalFunc callback);
+
+static TreeNode **dirty;/* nodes waiting to be reindexed, oldest first */
+static int nallocd;
+int ndirty;/* number of slots used, including NULL ones */
+unsigned long nreindexed;/* number of nodes that have been reindexed */
 
 /* return 1 if path is a directory, 0 if it is a non-directory and -1 if an
  * error occurred
@@ -24,20 +28,122 @@ int isdir(const char *path, int printerror) {
     return S_ISDIR(buf.st_mode) && !S_ISLNK(buf.st_mode);
 }
 
-/* reindex anything in the tree that has indexed=0 */
-void reindex(TreeNode *node, TreeNode *root) {
-    /* if this node isn't indexed, find out its name and index it, otherwise
-     * recurse on its children
+/* queue the node, which has indexed=0, to be indexed by the next reindex() */
+void mark_dirty(TreeNode *t) {
+    if(t->dirty)
+        return;
+
+    if(ndirty == nallocd) {
+        nallocd = nallocd ? nallocd * 2 : 64;
+        dirty = realloc(dirty, nallocd * sizeof(TreeNode *));
+    }
+
+    dirty[ndirty++] = t;
+    t->dirty = 1;
+}
+
+/* take the node, which is being freed, off the queue */
+void unmark_dirty(TreeNode *t) {
+    int i;
+
+    for(i = 0; i < ndirty; i++)
+        if(dirty[i] == t)
+            dirty[i] = NULL;
+
+    t->dirty = 0;
+}
+
+/* return 1 if the node is in the tree under root, and 0 if it (or a directory
+ * above it) has been removed
+ */
+static int in_tree(TreeNode *t, TreeNode *root) {
+    while(t->parent)
+        t = t->parent;
+
+    return t == root;
+}
+
+/* return 1 if the node is worth keeping queued: it is in the tree or it may
+ * be about to be put back
+ */
+static int still_wanted(TreeNode *t, TreeNode *root) {
+    return !t->indexed && (in_tree(t, root) || moving_ancestor(t));
+}
+
+/* index the nodes queued by mark_dirty(), and any queued while doing so; the
+ * ones that still can't be indexed stay queued for next time
+ * this is called from handle_inotify_events(), which is itself called while
+ * indexing, so it does nothing if it is already running
+ */
+void reindex(TreeNode *root) {
+    static int running;
+
+    if(running || !ndirty)
+        return;
+
+    /* the filesystem a capture came from isn't there to index; the capture
+     * records the watches that indexing added instead
      */
-    if(!node->indexed) {
-        char *name = treenode_name(node);
-        indexfrom(root, name);
-        free(name);
-    } else if(node->dir) {
+    if(replay_mode) {
         int i;
-        for(i = 0; i < node->dir->nchilds; i++)
-            reindex(node->dir->child[i], root);
+        for(i = 0; i < ndirty; i++) {
+            if(dirty[i]) {
+                dirty[i]->indexed = 1;
+                dirty[i]->dirty = 0;
+            }
+        }
+        ndirty = 0;
+        return;
     }
+
+    running = 1;
+
+    /* nothing removed from the tree meanwhile is freed until this is done,
+     * so the queued nodes stay valid
+     */
+    unsigned long gen = hold_treenodes();
+
+    PROBE1(reindex_start, ndirty);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* the nodes that are kept are moved to the front; they stay marked while
+     * they are tried, so each is only tried once
+     */
+    int nkept = 0;
+    int ntried = 0;
+    int i;
+    for(i = 0; i < ndirty; i++) {
+        TreeNode *t = dirty[i];
+        if(!t)
+            continue;
+
+        if(!t->indexed && in_tree(t, root)) {
+            char *name = treenode_name(t);
+            indexfrom(root, name);
+            free(name);
+            ntried++;
+
+            if(t->indexed && t->dir && in_tree(t, root))
+                record_indexed(t);
+        }
+
+        if(still_wanted(t, root))
+            dirty[nkept++] = t;
+        else
+            t->dirty = 0;
+    }
+    ndirty = nkept;
+    nreindexed += ntried;
+    count_reindex(seconds_since(&start));
+    PROBE2(reindex_end, ntried, ndirty);
+
+    if(debug_mode)
+        printf("reindexed %d nodes, %d still queued\n", ntried, ndirty);
+
+    release_treenodes(gen);
+
+    running = 0;
 }
 
 /* index the filesystem starting from the given path; print something to stderr
@@ -59,10 +165,10 @@ int indexfrom(TreeNode *root, const char *relpath) {
         char *p = strdup(relpath);
         TreeNode *t = lookup_treenode(root, p, 0);
         free(p);
-        if((!t || !t->complained) && !quiet_mode) {
+        if((!t || !t->complained) && !quiet_mode)
             fprintf(stderr, "realpath: %s: %s\n", relpath, strerror(errno));
+        if(t)
             t->complained = 1;
-        }
         return -1;
     }
 
@@ -86,13 +192,36 @@ int indexfrom(TreeNode *root, const char *relpath) {
         t->complained = 1;
         return -1;
     } else if(dir) {
-        t->dir = new_dirinfo(t);
-
         /* remove a trailing slash if there is one (note: "/" -> "" but that's
          * OK)
          */
         if(*path && path[strlen(path)-1] == '/')
             path[strlen(path)-1] = '\0';
+
+        /* a directory that has been indexed before, and was queued again
+         * because events for it had to be dropped while it was being moved,
+         * is brought up to date in place, keeping the nodes below it
+         */
+        if(t->dir && t->dir->children) {
+            if(rescan_directory(root, t, path) == -1) {
+                if(!t->complained)
+                    fprintf(stderr, "opendir: %s: %s\n", path,
+                            strerror(errno));
+                t->complained = 1;
+                return -1;
+            }
+            if(t->dir->wd == -1 && !t->dir->poll)
+                watch_directory(t, path);
+            t->indexed = 1;
+            return 0;
+        }
+
+        /* a directory that was created since the last index already has an
+         * empty DirInfo
+         */
+        if(!t->dir)
+            STORE_SHARED(t->dir, new_dirinfo(t));
+
         _indexfs(root, t, path);
     }
 
@@ -105,17 +234,11 @@ int indexfrom(TreeNode *root, const char *relpath) {
  * least PATH_MAX bytes of storage
  */
 static void _indexfs(TreeNode *root, TreeNode *node, char *path) {
-    static int procwarned = 0;
     char *endpath = path + strlen(path);
 
     assert(node->dir);/* can't index under a non-directory */
 
-    /* inotify doesn't work on /proc, but index it anyway */
-    if(!procwarned && strncmp(path, "/proc", 5) == 0) {
-        procwarned = 1;
-        fprintf(stderr, "warning: inotify watchers don't work under "
-                "/proc; indexing anyway but it will become stale\n");
-    }
+    PROBE1(index_dir_start, path);
 
     /* ensure the path is not too long */
     if(strlen(path) >= PATH_MAX-1) {
@@ -129,14 +252,17 @@ static void _indexfs(TreeNode *root, TreeNode *node, char *path) {
         if(!node->complained)
             fprintf(stderr, "opendir: %s: %s\n", path, strerror(errno));
         node->complained = 1;
+        mark_dirty(node);
+        PROBE2(index_dir_end, path, -1);
         return;
     }
 
-    /* watch this path with inotify */
+    /* watch this path with inotify (or poll it if it can't be watched) */
     watch_directory(node, path);
 
     /* loop over all of the entries in the directory */
     struct dirent *de;
+    int nentries = 0;
     while((de = readdir(dp))) {
         if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
             continue;
@@ -151,18 +277,24 @@ static void _indexfs(TreeNode *root, TreeNode *node, char *path) {
             exit(1);
         }
         strcat(path, de->d_name);
+        nentries++;
 
-        /* add a new node to the tree */
+        /* add a new node to the tree, as a directory if it is one so that
+         * its path is right as soon as it is visible
+         */
         TreeNode *child = new_treenode(de->d_name);
+        int dir = isdir(path, 1);
+        if(dir == 1)
+            child->dir = new_dirinfo(child);
         add_child(node, child);
+        journal_node(JF_CHANGE_CREATE, child);
 
         /* if this node is a directory, recurse */
-        int dir;
-        if((dir = isdir(path, !child->complained)) == -1) {
+        if(dir == -1) {
             child->complained = 1;
+            mark_dirty(child);
             continue;
         } else if(dir) {
-            child->dir = new_dirinfo(child);
             _indexfs(root, child, path);
         } else {
             /* non-directories need no further work */
@@ -174,25 +306,32 @@ static void _indexfs(TreeNode *root, TreeNode *node, char *path) {
 
     closedir(dp);
 
+    *endpath = '\0';
+    PROBE2(index_dir_end, path, nentries);
+
     /* now handle inotify events to keep the queue from overflowing */
     handle_inotify_events(root);
-
-    *endpath = '\0';
 }
 
-/* traverse the tree depth-first, starting at path, and call the callback for
- * every node;
- * if callback returns non-zero, the traversal will be halted;
- * returns 0 on a full tree traversal, and returns the value returned by the
- * callback in the case that the traversal is halted prematurely;
- * returns -1 on error (i.e. "path" is not in the tree or is too long)
+/* start a depth-first traversal of the tree at the given path; the paths are
+ * then obtained one at a time with traversal_next(), so that a traversal can
+ * be paused and resumed later, and the tree can change in between:
+ *  - the traversal holds the tree, so removed nodes are retired rather than
+ *    freed until the traversal is freed
+ *  - each directory's child array is traversed as it was when the traversal
+ *    reached it, except that children added or removed since then may or may
+ *    not be visited
+ *  - so nodes that are in the tree for the whole traversal are visited
+ *    exactly once, and nodes added, removed or moved during the traversal
+ *    are visited at most once in each place they appear
+ * returns NULL if "path" is not in the tree or is too long
  */
-int traverse(TreeNode *root, const char *path, TraversalFunc callback) {
+Traversal *new_traversal(TreeNode *root, const char *path) {
     assert(!root->parent);/* this should be actual root */
 
     /* fail if the path is too long, and copy it if it is ok */
     if(strlen(path) >= PATH_MAX)
-        return -1;
+        return NULL;
     char newpath[PATH_MAX];
     strcpy(newpath, path);
 
@@ -201,49 +340,162 @@ int traverse(TreeNode *root, const char *path, TraversalFunc callback) {
         newpath[strlen(newpath)-1] = '\0';
 
     /* lookup the node and fail if there is no such node */
-    TreeNode *t = lookup_treenode(root, newpath, 0);
-    if(!t)
-        return -1;
+    TreeNode *t;
+    if(!(t = lookup_treenode(root, newpath, 0)))
+        return NULL;
+
+    /* the node's name is appended to its parent's path */
+    char *slash = strrchr(newpath, '/');
+    newpath[slash ? slash - newpath + 1 : 0] = '\0';
 
-    /* do the actual traversal */
-    return _traverse(t, newpath, callback);
+    return new_node_traversal(t, newpath, 1);
 }
 
-/* traverse the entire tree depth-first, calling the callback for every path;
- * path will be modified but will be restored to its original state, and
- * should have at least PATH_MAX bytes of storage;
- * if callback returns non-zero, the traversal will be halted and the returned
- * value will be teturned;
- * returns 0 on a full tree traversal, and returns the value returned by the
- * callback in the case that the traversal is halted prematurely
+/* allocate a traversal that starts with the given path and holds the tree */
+static Traversal *alloc_traversal(const char *path) {
+    Traversal *tr = malloc(sizeof(Traversal));
+
+    memset(tr, 0, sizeof(Traversal));
+    strcpy(tr->path, path);
+    tr->gen = hold_treenodes();
+
+    return tr;
+}
+
+/* add a frame for the children of a directory to the traversal, to visit
+ * child[lo] up to (but not including) child[hi] of the array, or up to the
+ * end of the array (however long it gets) if hi is -1
  */
-static int _traverse(TreeNode *t, char *path, TraversalFunc callback) {
-    char *endpath = path + strlen(path);
+static void push_frame(Traversal *tr, ChildArray *a, int lo, int hi,
+        int pathlen) {
+    if(tr->nframes == tr->nallocd) {
+        tr->nallocd = tr->nallocd ? tr->nallocd * 2 : 16;
+        tr->frame = realloc(tr->frame, tr->nallocd * sizeof(TraversalFrame));
+    }
+    tr->frame[tr->nframes].a = a;
+    tr->frame[tr->nframes].child = lo;
+    tr->frame[tr->nframes].end = hi;
+    tr->frame[tr->nframes].pathlen = pathlen;
+    tr->nframes++;
+}
+
+/* start a traversal at the given node, whose parent has the given path
+ * (ending in a slash, or empty for the root); if descend is 0, only the node
+ * itself is visited
+ */
+Traversal *new_node_traversal(TreeNode *t, const char *parentpath,
+        int descend) {
+    Traversal *tr = alloc_traversal(parentpath);
+
+    tr->next = t;
+    tr->nextlen = strlen(parentpath);
+    tr->descend = descend;
+
+    return tr;
+}
+
+/* start a traversal of the subtrees rooted at child[lo] up to (but not
+ * including) child[hi] of the given child array, belonging to the directory
+ * with the given path (ending in a slash)
+ */
+Traversal *new_range_traversal(ChildArray *a, int lo, int hi,
+        const char *dirpath) {
+    Traversal *tr = alloc_traversal(dirpath);
+
+    push_frame(tr, a, lo, hi, strlen(dirpath));
+    tr->descend = 1;
+
+    return tr;
+}
+
+/* advance the traversal to the next node and point *path at its name; the
+ * name is only valid until the next call
+ * returns 1 if there was a node and 0 if the traversal is finished
+ */
+int traversal_next(Traversal *tr, char **path) {
+    TreeNode *t;
+    int pathlen;
+
+    if(tr->next) {
+        /* this is the first node */
+        t = tr->next;
+        pathlen = tr->nextlen;
+        tr->next = NULL;
+    } else {
+        /* pop frames until we find one with an unvisited child, skipping
+         * over removed children
+         */
+        t = NULL;
+        while(tr->nframes && !t) {
+            TraversalFrame *f = tr->frame + tr->nframes - 1;
+            if(f->child < LOAD_SHARED(f->a->nchilds)
+                    && (f->end == -1 || f->child < f->end)) {
+                t = LOAD_SHARED(f->a->child[f->child]);
+                f->child++;
+                pathlen = f->pathlen;
+            } else {
+                tr->nframes--;
+            }
+        }
+        if(!t)
+            return 0;
+    }
+
+    char *name = LOAD_SHARED(t->name);
+    DirInfo *dir = LOAD_SHARED(t->dir);
 
     /* check that the name is small enough */
-    if(strlen(t->name) > PATH_MAX - 2 - strlen(path)) {
+    if(strlen(name) > PATH_MAX - 2 - pathlen) {
+        tr->path[pathlen] = '\0';
         fprintf(stderr, "error: %s: %s: strlen(t->name) too long!\n",
-                path, t->name);
+                tr->path, name);
         exit(1);
     }
-    strcat(path, t->name);
-    if(t->dir)
-        strcat(path, "/");
+    strcpy(tr->path + pathlen, name);
+    if(dir)
+        strcat(tr->path, "/");
 
-    /* call the user-supplied callback */
-    int n;
-    if((n = callback(path)))
-        return n;
+    /* if this is a directory with children, they come next */
+    ChildArray *a = dir ? LOAD_SHARED(dir->children) : NULL;
+    if(a && tr->descend)
+        push_frame(tr, a, 0, -1, strlen(tr->path));
 
-    /* recurse if this is a directory */
-    if(t->dir) {
-        int i;
-        for(i = 0; i < t->dir->nchilds; i++)
-            if((n = _traverse(t->dir->child[i], path, callback)))
-                return n;
-    }
+    *path = tr->path;
+    return 1;
+}
 
-    *endpath = '\0';
+/* free the given traversal */
+void free_traversal(Traversal *tr) {
+    if(!tr)
+        return;
 
-    return 0;
+    release_treenodes(tr->gen);
+
+    free(tr->frame);
+    free(tr);
+}
+
+/* traverse the tree depth-first, starting at path, and call the callback for
+ * every node;
+ * if callback returns non-zero, the traversal will be halted;
+ * returns 0 on a full tree traversal, and returns the value returned by the
+ * callback in the case that the traversal is halted prematurely;
+ * returns -1 on error (i.e. "path" is not in the tree or is too long)
+ */
+int traverse(TreeNode *root, const char *path, TraversalFunc callback) {
+    Traversal *tr;
+
+    if(!(tr = new_traversal(root, path)))
+        return -1;
+
+    /* call the callback for each node */
+    char *p;
+    int n = 0;
+    while(traversal_next(tr, &p))
+        if((n = callback(p)))
+            break;
+
+    free_traversal(tr);
+
+    return n;
 }
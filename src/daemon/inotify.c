@@ -8,6 +8,7 @@
 #define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
 
 int inotify_fd;
+int max_watches = -1;/* the most watches to use; -1 until decided */
 
 /* structure for handler functions for inotify events */
 struct MaskFunc {
@@ -40,115 +41,407 @@ static struct MaskFunc maskfunc[] = {
     { 0,         0 }
 };
 
-/* initialise inotify, printing a message and dying if there is a problem */
+/* watch the given directory (corresponding to the given node) with inotify
+ * return 0 on success, and print an error (unless it is because there are no
+ * watches left) and return -1 on failure
+ */
+int add_watch(TreeNode *t, const char *path) {
+    static int warned;
+    int wd;
+
+    assert(t->dir);/* the node must be a directory */
+
+    /* add the watch, and store it in the hash table if successful */
+    if((wd = inotify_add_watch(inotify_fd, path, WATCH_MASK)) == -1) {
+        /* something else is using the watches we thought we could have */
+        if(errno == ENOSPC) {
+            max_watches = watch_count();
+            if(!warned)
+                fprintf(stderr, "warning: ran out of inotify watches after "
+                        "%d; polling directories instead (perhaps you need "
+                        "to increase /proc/sys/fs/inotify/max_user_watches)\n",
+                        max_watches);
+            warned = 1;
+        } else {
+            fprintf(stderr, "inotify_add_watch: %s: %s\n", path,
+                    strerror(errno));
+        }
+        return -1;
+    }
+
+    /* inotify gives back the same wd for a directory that is already
+     * watched; it may be watched through another node, if it was moved out
+     * of the tree and back in before that node's move expired, in which case
+     * the watch belongs to this node now
+     */
+    if(dirinfo_for_wd(wd) != t->dir) {
+        remove_wd(wd);
+
+        /* a watch the node already has is of a directory that was replaced
+         * by this one
+         */
+        if(t->dir->wd != -1) {
+            int old = t->dir->wd;
+            remove_wd(old);
+            inotify_rm_watch(inotify_fd, old);
+        }
+
+        t->dir->wd = wd;
+        set_treenode_for_wd(wd, t);
+    }
+    t->dir->active = time(NULL);
+
+    return 0;
+}
+
+/* watch the given directory (corresponding to the given node) with inotify,
+ * or poll it if it can't be watched: because it's on a pseudo-filesystem
+ * where inotify doesn't work, or because all of the watches we may use are
+ * in use
+ */
+void watch_directory(TreeNode *t, const char *path) {
+    static int warned;
+    struct statfs sfs;
+
+    int pseudo = statfs(path, &sfs) == 0
+        && (sfs.f_type == PROC_SUPER_MAGIC || sfs.f_type == SYSFS_MAGIC);
+
+    if(!pseudo && watch_count() >= max_watches && !warned) {
+        fprintf(stderr, "warning: using all %d inotify watches allowed; "
+                "polling directories instead\n", max_watches);
+        warned = 1;
+    }
+
+    if(pseudo || watch_count() >= max_watches || add_watch(t, path) == -1)
+        poll_directory(t, path, pseudo);
+}
+
+/* stop watching the given directory, and poll it instead */
+void unwatch_directory(TreeNode *t) {
+    int wd = t->dir->wd;
+
+    /* forget the wd first, so that the events still to come for it are
+     * ignored
+     */
+    remove_wd(wd);
+    inotify_rm_watch(inotify_fd, wd);
+
+    poll_unwatched(t);
+}
+
+/* the events read from inotify in one go */
+typedef struct InotifyBatch {
+    char *buf;
+    struct inotify_event **event;/* in the order they were read */
+    char *dropped;/* 1 for each event that coalescing made unnecessary */
+    struct SortedEvent *sorted;
+    int nevents;
+} InotifyBatch;
+
+/* an event and its index in the batch, for sorting by watch and name */
+typedef struct SortedEvent {
+    struct inotify_event *ev;
+    int i;
+} SortedEvent;
+
+#define MAX_BATCH_EVENTS (INOTIFY_BUFSIZE / sizeof(struct inotify_event))
+
+static InotifyBatch batch;
+
+unsigned long inotify_events;/* events read */
+unsigned long inotify_coalesced;/* events that didn't need handling */
+unsigned long inotify_rate;/* events read per second, over the last second */
+unsigned long inotify_overflows;/* times the kernel's event queue overflowed */
+
+/* initialise inotify and start the thread that reads its events, printing a
+ * message and dying if there is a problem
+ */
 void init_inotify(void) {
-    if((inotify_fd = inotify_init()) == -1) {
-        perror("inotify_init");
+    if((inotify_fd = inotify_init1(IN_NONBLOCK)) == -1) {
+        perror("inotify_init1");
         exit(1);
     }
+
+    /* leave some of the user's watches for other programs */
+    if(max_watches < 0) {
+        FILE *fp = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+        if(!fp || fscanf(fp, "%d", &max_watches) != 1)
+            max_watches = 8192;
+        if(fp)
+            fclose(fp);
+        max_watches = (long)max_watches * WATCH_SHARE / 100;
+    }
+
+    start_reader();
 }
 
-/* watch the given directory (corresponding to the given node) with inotify;
- * print an error and return as normal if watching fails
+/* stop reading inotify events and close the inotify fd, forgetting about
+ * any events that haven't been handled
  */
-void watch_directory(TreeNode *t, const char *path) {
-    assert(t->dir);/* the node must be a directory */
+void stop_inotify(void) {
+    stop_reader();
+    close(inotify_fd);
+}
 
-    /* add the watch, and store it in the hash table if successful */
-    if((t->dir->wd = inotify_add_watch(inotify_fd, path, WATCH_MASK)) == -1) {
-        fprintf(stderr, "inotify_add_watch: %s: %s\n", path, strerror(errno));
+/* order events by watch, then name, then the order they were read in */
+static int compare_events(const void *a, const void *b) {
+    const SortedEvent *x = a, *y = b;
 
-        /* give a helpful error message in the event of ENOSPC */
-        if(errno == ENOSPC) {
-            fprintf(stderr, "perhaps you need to increase "
-                            "/proc/sys/fs/inotify/max_user_watches\n");
-            exit(1);
+    if(x->ev->wd != y->ev->wd)
+        return x->ev->wd < y->ev->wd ? -1 : 1;
+
+    int c = strcmp(x->ev->name, y->ev->name);
+    if(c)
+        return c;
+
+    return x->i - y->i;
+}
+
+/* return 1 if the events are for the same name in the same directory */
+static int same_name(struct inotify_event *a, struct inotify_event *b) {
+    return a->wd == b->wd && strcmp(a->name, b->name) == 0;
+}
+
+/* mark the events in the batch that make no difference to the tree, looking
+ * at each name in each directory on its own:
+ *  - a create followed by a delete is dropped, and so is the delete if the
+ *    name was already deleted before the create; otherwise the delete is
+ *    kept in case the file was already known about
+ *  - a create or delete straight after another of the same is dropped
+ * a move of the name stops anything before it being coalesced with anything
+ * after it
+ */
+static void coalesce_events(InotifyBatch *b) {
+    int n = 0;
+    int i;
+
+    for(i = 0; i < b->nevents; i++) {
+        struct inotify_event *ev = b->event[i];
+        if(ev->len && (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                | IN_MOVED_TO))) {
+            b->sorted[n].ev = ev;
+            b->sorted[n].i = i;
+            n++;
+        }
+    }
+
+    qsort(b->sorted, n, sizeof(SortedEvent), compare_events);
+
+    int create = -1;/* the create of the name still to be handled, if any */
+    int deleted = 0;/* 1 if a delete of the name is still to be handled */
+    for(i = 0; i < n; i++) {
+        SortedEvent *e = b->sorted + i;
+
+        if(i && !same_name(e->ev, e[-1].ev)) {
+            create = -1;
+            deleted = 0;
+        }
+
+        if(e->ev->mask & IN_CREATE) {
+            if(create != -1)
+                b->dropped[e->i] = 1;
+            else
+                create = e->i;
+        } else if(e->ev->mask & IN_DELETE) {
+            if(create != -1) {
+                b->dropped[create] = 1;
+                create = -1;
+            }
+            if(deleted)
+                b->dropped[e->i] = 1;
+            deleted = 1;
+        } else {
+            create = -1;
+            deleted = 0;
         }
-    } else {
-        set_treenode_for_wd(t->dir->wd, t);
     }
 }
 
-/* deal with any new inotify events
+/* handle the event, calling the function for each of its masks
  * return 0 on success and -1 on failure
  */
-int handle_inotify_events(TreeNode *root) {
-#define INOTIFY_BUFSZ 4096
-    char buf[INOTIFY_BUFSZ];
-
-    /* poll with a 0 timeout just to see if there is anything to read */
-    struct pollfd fds = { inotify_fd, POLLIN };
-    if(poll(&fds, 1, 0) == -1) {
-        perror("poll");
-        exit(1);
+static int handle_event(TreeNode *root, struct inotify_event *ev) {
+    /* report failure if the inotify event queue overflowed */
+    if(ev->mask & IN_Q_OVERFLOW) {
+        inotify_overflows++;
+        fprintf(stderr, "warning: inotify event queue overflow\n");
+        return -1;
     }
-    if(!(fds.revents & POLLIN))
+
+    /* lookup the node this wd describes */
+    TreeNode *t = treenode_for_wd(ev->wd);
+
+    /* don't do anything if we are being told to ignore a node we are
+     * already ignoring, or about a watch we have stopped using
+     */
+    if(!t)
         return 0;
 
-    /* read from the inotify fd */
-    int n;
-    if((n = read(inotify_fd, buf, INOTIFY_BUFSZ)) <= 0) {
-        if(n < 0)
-            perror("inotify: read");
-        else
-            fprintf(stderr, "error: eof on inotify fd\n");
+    /* the least active watches are the ones to give up */
+    t->dir->active = time(NULL);
+
+    /* events from inside a directory that has been moved away may be about
+     * somewhere outside the tree; if it turns out it hasn't left the tree,
+     * the directory is read again in case they mattered
+     */
+    if(nmoves && moving_ancestor(t)) {
+        if(ev->mask & IN_IGNORED)
+            remove_wd(ev->wd);
+        t->indexed = 0;
+        mark_dirty(t);
+        return 0;
+    }
+
+    /* call the appropriate function for each mask */
+    int called = 0;
+    int i;
+    for(i = 0; maskfunc[i].mask; i++) {
+        if(ev->mask & maskfunc[i].mask) {
+            maskfunc[i].func(root, t, ev);
+            called = 1;
+        }
+    }
+
+    /* complain if we didn't call any handler functions */
+    if(!called) {
+        fprintf(stderr, "error: received inotify event with unknown mask "
+                "0x%08x!\n", ev->mask);
         exit(1);
     }
 
-    /* handle each event */
+    return 0;
+}
+
+/* count the events that have been read, and work out the rate once a
+ * second
+ */
+static void count_events(int nevents, int ndropped) {
+    static time_t window;
+    static unsigned long windowevents;
+
+    inotify_events += nevents;
+    inotify_coalesced += ndropped;
+    windowevents += nevents;
+
+    time_t now = time(NULL);
+    if(now != window) {
+        inotify_rate = window ? windowevents / (now - window) : windowevents;
+        window = now;
+        windowevents = 0;
+    }
+
+    if(debug_mode)
+        printf("inotify: %d events, %d coalesced (%lu%% of %lu so far), "
+                "%lu events/s\n", nevents, ndropped,
+                inotify_coalesced * 100 / inotify_events, inotify_events,
+                inotify_rate);
+}
+
+/* allocate the buffers for the batch if they haven't been already */
+static void alloc_batch(InotifyBatch *b) {
+    if(b->buf)
+        return;
+
+    b->buf = malloc(INOTIFY_BUFSIZE);
+    b->event = malloc(MAX_BATCH_EVENTS * sizeof(struct inotify_event *));
+    b->dropped = malloc(MAX_BATCH_EVENTS);
+    b->sorted = malloc(MAX_BATCH_EVENTS * sizeof(SortedEvent));
+}
+
+/* coalesce the n bytes of events in the batch's buffer and then update the
+ * tree
+ * return 0 on success and -1 on failure
+ */
+static int handle_batch(TreeNode *root, InotifyBatch *b, int n) {
+    /* split the buffer into events */
     struct inotify_event *ev;
     int p = 0;
+    b->nevents = 0;
     while(p < n) {
-        ev = (struct inotify_event*)(buf + p);
+        ev = (struct inotify_event*)(b->buf + p);
         p += ev->len + sizeof(struct inotify_event);
 
         /* output the event if in debug mode */
         if(debug_mode)
             _print_inotify_event(ev);
 
-        /* report failure if the inotify event queue overflowed */
-        if(ev->mask & IN_Q_OVERFLOW) {
-            fprintf(stderr, "warning: inotify event queue overflow\n");
-            return -1;
-        }
+        b->dropped[b->nevents] = 0;
+        b->event[b->nevents++] = ev;
+    }
 
-        /* lookup the node this wd describes */
-        TreeNode *t = treenode_for_wd(ev->wd);
+    assert(p == n);/* we should use up *exactly* n bytes, no more */
 
-        /* don't do anything if we are being told to ignore a node we are
-         * already ignoring
-         */
-        if(!t) {
-            assert(ev->mask == IN_IGNORED);/* we can't handle unknown nodes */
+    coalesce_events(b);
+    PROBE1(inotify_batch_start, b->nevents);
+
+    /* handle each event that still needs handling */
+    int ndropped = 0;
+    int i;
+    for(i = 0; i < b->nevents; i++) {
+        ev = b->event[i];
+        if(b->dropped[i]) {
+            PROBE2(inotify_event_dropped, ev->wd, ev->mask);
+            ndropped++;
             continue;
         }
+        PROBE4(inotify_event, ev->wd, ev->mask, ev->cookie,
+                ev->len ? ev->name : "");
+        if(handle_event(root, ev) == -1)
+            return -1;
+        PROBE2(inotify_event_done, ev->wd, ev->mask);
+    }
 
-        /* call the appropriate function for each mask */
-        int called = 0;
-        int i;
-        for(i = 0; maskfunc[i].mask; i++) {
-            if(ev->mask & maskfunc[i].mask) {
-                maskfunc[i].func(root, t, ev);
-                called = 1;
-            }
-        }
+    count_events(b->nevents, ndropped);
 
-        /* complain if we didn't call any handler functions */
-        if(!called) {
-            fprintf(stderr, "error: received inotify event with unknown mask "
-                    "0x%08x!\n", ev->mask);
-            exit(1);
-        }
-    }
+    /* index the directories that have appeared or lost their watches; this
+     * handles events itself while indexing, which is fine now that this
+     * batch is finished with
+     */
+    reindex(root);
 
-    assert(p == n);/* we should use up *exactly* n bytes, no more */
+    /* tell subscribers about the changes */
+    flush_subscriptions();
+
+    PROBE2(inotify_batch_end, b->nevents, ndropped);
+
+    return 0;
+}
+
+/* deal with all of the inotify events that the reader thread has read, a
+ * buffer-full at a time: coalesce each buffer-full and then update the tree
+ * return 0 on success and -1 on failure
+ */
+int handle_inotify_events(TreeNode *root) {
+    InotifyBatch *b = &batch;
+
+    alloc_batch(b);
+
+    int n;
+    while((n = take_events(b->buf, INOTIFY_BUFSIZE))) {
+        record_events(b->buf, n);
 
-    /* reindex anything that has indexed=0 */
-    reindex(root, root);
+        if(handle_batch(root, b, n) == -1)
+            return -1;
+    }
 
     return 0;
 }
 
+/* handle the n bytes of events from a capture in buf, which must be no more
+ * than INOTIFY_BUFSIZE, as if the reader thread had read them
+ * return 0 on success and -1 on failure
+ */
+int replay_events(TreeNode *root, const char *buf, int n) {
+    InotifyBatch *b = &batch;
+
+    assert(n <= INOTIFY_BUFSIZE);
+
+    alloc_batch(b);
+    memcpy(b->buf, buf, n);
+
+    return handle_batch(root, b, n);
+}
+
 /* handle an IN_CREATE event */
 void _inotify_create(TreeNode *root, TreeNode *parent,
         struct inotify_event *ev) {
@@ -161,33 +454,38 @@ void _inotify_create(TreeNode *root, TreeNode *parent,
         return;
 
     TreeNode *new = new_treenode(ev->name);
-    add_child(parent, new);
 
     char *parentname = treenode_name(parent);
     char *newname = strallocat(parentname, ev->name, NULL);
     free(parentname);
 
-    /* find out if this new file is a directory, and mark it as complained if
-     * isdir() fails (and complains about it)
+    /* find out if this new file is a directory before adding it, so that its
+     * path is right as soon as it is visible; it is indexed by reindex()
+     * a capture being replayed has only the event to go on
      */
-    int dir;
-    if((dir = isdir(newname, !new->complained)) == -1) {
-        new->complained = 1;
-        free(newname);
-        return;
-    }
-
+    int dir = replay_mode ? !!(ev->mask & IN_ISDIR) : isdir(newname, 1);
+    if(dir == 1)
+        new->dir = new_dirinfo(new);
     free(newname);
 
+    add_child(parent, new);
+    journal_node(JF_CHANGE_CREATE, new);
+
+    /* mark it as complained if isdir() failed (and complained about it) */
+    if(dir == -1)
+        new->complained = 1;
+
     /* no further work necessary if it is not a directory */
     if(!dir)
         new->indexed = 1;
+    else
+        mark_dirty(new);
 }
 
 /* handle an IN_DELETE event */
 void _inotify_delete(TreeNode *root, TreeNode *parent,
         struct inotify_event *ev) {
-    TreeNode *t = remove_path(parent, ev->name);
+    TreeNode *t = lookup_treenode(parent, ev->name, 0);
 
     /* don't do anything if we didn't know about this file (possibly it got
      * deleted during the race window between adding the watcher and indexing
@@ -196,7 +494,10 @@ void _inotify_delete(TreeNode *root, TreeNode *parent,
     if(!t)
         return;
 
-    free_treenode(t);
+    journal_node(JF_CHANGE_DELETE, t);
+
+    remove_treenode(t);
+    retire_treenode(t);
 }
 
 /* handle an IN_MOVED_FROM event */
@@ -211,34 +512,44 @@ void _inotify_moved_from(TreeNode *root, TreeNode *parent,
     if(!t)
         return;
 
+    /* take it out of the tree until it turns up again */
     set_node_moved_from(ev->cookie, t);
 }
 
 /* handle an IN_MOVED_TO event */
 void _inotify_moved_to(TreeNode *root, TreeNode *parent,
         struct inotify_event *ev) {
-    TreeNode *t = node_for_cookie(ev->cookie);
+    char *oldname;
+    TreeNode *t = node_for_cookie(ev->cookie, &oldname);
+
+    /* remove a node with the same name if there is one there already */
+    TreeNode *old = lookup_treenode(parent, ev->name, 0);
+    if(old) {
+        journal_node(JF_CHANGE_DELETE, old);
+        remove_treenode(old);
+        retire_treenode(old);
+    }
 
-    /* don't do anything if we didn't know about this cookie (possibly the move
-     * was during the race window between adding the watcher and indexing the
-     * directory, meaning _inotify_moved_from never set the treenode for this
-     * cookie)
+    /* if we didn't know about this cookie, the node was moved in from outside
+     * the tree (or the move was during the race window between adding the
+     * watcher and indexing the directory, or it came too late), so it is new
+     * and anything below it gets indexed
      */
-    if(!t)
+    if(!t) {
+        _inotify_create(root, parent, ev);
         return;
-
-    /* remove the node from its old place in the tree */
-    remove_treenode(t);
-
-    /* remove a node with the same name if there is one there already */
-    free_treenode(remove_path(parent, ev->name));
+    }
 
     /* fix the filename */
-    free(t->name);
-    t->name = strdup(ev->name);
+    rename_treenode(t, ev->name);
 
     /* insert the node under its new parent */
     add_child(parent, t);
+
+    char *newname = treenode_name(t);
+    journal_change(JF_CHANGE_RENAME, oldname, newname);
+    free(oldname);
+    free(newname);
 }
 
 /* handle an IN_IGNORED event */
@@ -253,6 +564,7 @@ void _inotify_ignored(TreeNode *root, TreeNode *parent,
      * that fails, only then will we print an error message
      */
     parent->indexed = 0;
+    mark_dirty(parent);
 }
 
 /* print the given inotify event in the form:
@@ -7,16 +7,22 @@
 
 int debug_mode = 0;
 int quiet_mode = 0;
+int unordered_mode = 0;
 const char *socket_path = SOCKET_PATH;
 
 static TreeNode *root;
 
 static struct option opts[] = {
-    { "debug",  no_argument,       0, 'd' },
-    { "help",   no_argument,       0, 'h' },
-    { "quiet",  no_argument,       0, 'q' },
-    { "socket", required_argument, 0, 's' },
-    { 0,        0,                 0,  0  }
+    { "debug",     no_argument,       0, 'd' },
+    { "help",      no_argument,       0, 'h' },
+    { "quiet",     no_argument,       0, 'q' },
+    { "record",    required_argument, 0, 'r' },
+    { "snapshot",  no_argument,       0, 'm' },
+    { "socket",    required_argument, 0, 's' },
+    { "threads",   required_argument, 0, 'j' },
+    { "unordered", no_argument,       0, 'u' },
+    { "watches",   required_argument, 0, 'w' },
+    { 0,           0,                 0,  0  }
 };
 
 /* --help output */
@@ -29,8 +35,19 @@ static void help(void) {
     "Options:\n"
     "  -d, --debug        Output debugging information\n"
     "  -h, --help         Display this help\n"
+    "  -j, --threads N    Run searches in N threads (default: one per CPU;\n"
+    "                     0 runs them in the main thread)\n"
+    "  -m, --snapshot     Publish snapshots of the index for jfind -m to\n"
+    "                     search without asking the daemon\n"
     "  -q, --quiet        Suppress a lot of error messages\n"
+    "  -r, --record FILE  Record the inotify events handled to FILE, for\n"
+    "                     src/bench/replay\n"
     "  -s, --socket FILE  Set the path to the communication socket\n"
+    "  -u, --unordered    Send results as soon as they are found instead of\n"
+    "                     in tree order (faster with several threads)\n"
+    "  -w, --watches N    Use at most N inotify watches, and poll the\n"
+    "                     directories beyond that (default: 90%% of\n"
+    "                     max_user_watches; 0 polls every directory)\n"
     "\n"
     "Report bugs to James Stanley <james@incoherency.co.uk>\n"
     );
@@ -42,11 +59,26 @@ static double difftimeofday(struct timeval *start, struct timeval *stop) {
         + (stop->tv_usec - start->tv_usec) / 1000000.0;
 }
 
+/* return the number in s, or -1 if s isn't a non-negative number */
+static int parse_count(const char *s) {
+    char *end;
+
+    errno = 0;
+    long n = strtol(s, &end, 10);
+    if(!*s || *end || errno || n < 0 || n > INT_MAX)
+        return -1;
+
+    return n;
+}
+
 int main(int argc, char **argv) {
     /* parse options */
     opterr = 0;
     int c;
-    while((c = getopt_long(argc, argv, "dhqs:", opts, NULL)) != -1) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1)
+        threads = 1;/* in case sysconf() fails */
+    while((c = getopt_long(argc, argv, "dhj:mqr:s:uw:", opts, NULL)) != -1) {
         switch(c) {
             case 'd':
                 debug_mode = 1;
@@ -56,14 +88,42 @@ int main(int argc, char **argv) {
                 help();
                 return 0;
 
+            case 'j':
+                if((threads = parse_count(optarg)) == -1) {
+                    fprintf(stderr, "error: bad number of threads: %s\n"
+                            "See --help for more details\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'm':
+                snapshot_mode = 1;
+                break;
+
             case 'q':
                 quiet_mode = 1;
                 break;
 
+            case 'r':
+                record_path = optarg;
+                break;
+
             case 's':
                 socket_path = optarg;
                 break;
 
+            case 'u':
+                unordered_mode = 1;
+                break;
+
+            case 'w':
+                if((max_watches = parse_count(optarg)) == -1) {
+                    fprintf(stderr, "error: bad number of watches: %s\n"
+                            "See --help for more details\n", optarg);
+                    return 1;
+                }
+                break;
+
             case '?':
                 fprintf(stderr, "error: unknown option '%c'\n", optopt);
                 return 1;
@@ -92,6 +152,15 @@ int main(int argc, char **argv) {
 
     int init_optind = optind;
 
+    /* allow as many clients as the hard limit on open files allows */
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    init_workers(threads);
+
     while(1) {
         init_inotify();
 
@@ -112,11 +181,21 @@ int main(int argc, char **argv) {
 
         fprintf(stderr, "Indexing took %.3fs.\n",
                 difftimeofday(&start, &stop));
+        count_index(difftimeofday(&start, &stop));
+
+        /* remember changes from now on */
+        start_journal();
+        start_recording(root);
 
         /* handle inotify events and client requests */
         run(root, socket_path);
         /* if run() returns, something terrible has happened */
 
+        /* changes since the tree was indexed are lost */
+        stop_journal();
+        stop_snapshot();
+        clear_cache();
+
         /* sleep a while and then double the sleep period */
         fprintf(stderr, "warning: sleeping %d secs\n", reindex_secs);
         sleep(reindex_secs);
@@ -125,6 +204,7 @@ int main(int argc, char **argv) {
             reindex_secs = max_reindex_secs;
 
         /* now clear all state */
+        forget_moves();
         free_treenode(root);
     }
 
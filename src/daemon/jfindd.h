@@ -3,12 +3,19 @@
  * James Stanley 2012
  */
 
+#define _GNU_SOURCE
+
 #include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/un.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <arpa/inet.h>
 #include <limits.h>
 #include <unistd.h>
 #include <signal.h>
@@ -20,10 +27,34 @@
 #include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 
 #include "uthash.h"
+#include "probes.h"
 #include "../config.h"
+#include "../protocol.h"
+#include "../snapshot.h"
+#include "../capture.h"
+
+/* traversals read the tree from worker threads while the main thread changes
+ * it; anything that is changed in place while it may be being read is
+ * written with STORE_SHARED and read with LOAD_SHARED
+ */
+#define STORE_SHARED(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define LOAD_SHARED(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/* the children of a directory; since other threads may be reading the array
+ * while it is being changed, children are only ever appended to the end or
+ * replaced with NULL, and anything else is done by making a new array
+ */
+typedef struct ChildArray {
+    int nchilds;/* number of slots used, including NULL ones */
+    int nallocd;
+    int nremoved;/* number of NULL slots */
+    struct TreeNode *child[];
+} ChildArray;
 
 /* store information for a directory
  * this is a separate structure to TreeNode in the interest of saving memory
@@ -31,15 +62,32 @@
 typedef struct DirInfo {
     struct TreeNode *t;/* the TreeNode this DirInfo describes */
     int wd;/* watch descriptor */
-    int nchilds;
-    struct TreeNode **child;
+    ChildArray *children;/* NULL if there have never been any */
+    int nnodes;/* number of nodes below this directory */
+    unsigned long changed;/* tree_generation when anything below changed */
+    unsigned long added;/* tree_generation when it was put in its place */
+    time_t active;/* when its watch last had an event */
+    struct PollState *poll;/* NULL unless it is polled instead of watched */
     UT_hash_handle hh;/* for the hash table mapping wd to DirInfo */
 } DirInfo;
 
+/* the state of a directory that is polled because it can't be watched */
+typedef struct PollState {
+    DirInfo *d;
+    struct timespec mtime;/* as it was when the directory was last read */
+    time_t next;/* when to check it next */
+    int interval;/* seconds between checks */
+    int busy;/* number of checks in a row that found changes */
+    int pseudo;/* 1 if it is on a filesystem whose mtimes don't change */
+    int heapidx;/* its place in the heap of polled directories */
+} PollState;
+
 /* store information for an arbitrary node in the fs tree */
 typedef struct TreeNode {
     char indexed;/* 1 if this node is indexed, else 0 */
     char complained;/* 1 if this node has had an error printed, else 0 */
+    char dirty;/* 1 if it is queued to be reindexed, else 0 */
+    char moving;/* 1 if it is out of the tree waiting for IN_MOVED_TO */
     struct TreeNode *parent;/* the parent node (should be a directory) */
     char *name;
     DirInfo *dir;/* directory information for non-file nodes */
@@ -52,25 +100,193 @@ typedef struct TreeNode {
 typedef struct NodeMove  {
     int cookie;/* the "cookie" field from the inotify event */
     TreeNode *node;/* the node that is being moved */
+    char *path;/* where it was moved from */
+    long when;/* when it was moved, in milliseconds */
     UT_hash_handle hh;/* for the hash table mapping cookie to NodeMove */
 } NodeMove;
 
+/* one level of a depth-first traversal: the child array being traversed, the
+ * index of the next child to visit (and of the one to stop at, or -1), and the
+ * length of the directory's path
+ */
+typedef struct TraversalFrame {
+    ChildArray *a;
+    int child;
+    int end;
+    int pathlen;
+} TraversalFrame;
+
+/* state for a depth-first traversal that can be paused and resumed */
+typedef struct Traversal {
+    unsigned long gen;/* generation of the hold on the tree */
+    char path[PATH_MAX];/* path of the most recently visited node */
+    TreeNode *next;/* the first node, if it has not been visited yet */
+    int nextlen;/* length of the path to the first node's parent */
+    int descend;/* 0 if only the first node is to be visited */
+    TraversalFrame *frame;/* stack of directories being traversed */
+    int nframes;
+    int nallocd;
+} Traversal;
+
+/* queue of search results on their way to a client; results are batched up
+ * so that a search costs one write() per buffer-full instead of two per
+ * match, and the search pauses while the queue is full so that a client that
+ * stops reading doesn't block the daemon
+ */
+typedef struct OutBuffer {
+    char *buf;
+    int start;/* offset of the first unsent byte */
+    int nbytes;/* offset of the end of the queued data */
+    int nallocd;
+} OutBuffer;
+
+/* a piece of a search that can be run by one worker thread */
+typedef struct SearchPart {
+    Traversal *tr;
+    OutBuffer out;/* results that haven't been passed on to the client yet */
+    int done;/* 1 once the traversal has finished */
+    int busy;/* 1 while a worker thread is running it */
+    int nresults;
+    long nvisited;/* number of nodes the traversal has visited */
+    struct Search *search;
+    struct SearchPart *next;/* for the workers' queues */
+} SearchPart;
+
+/* a search in progress; its results are passed on from each part in turn,
+ * or as soon as they are found if the search is unordered
+ */
+typedef struct Search {
+    char *term;
+    int unordered;
+    char sep;/* byte written after each result */
+    SearchPart *part;
+    int nparts;
+    int nallocd;
+    int head;/* the first part whose results haven't all been passed on */
+    int nbusy;/* number of parts being run by workers */
+    int size;/* number of nodes in the subtree being searched */
+    struct timespec started;/* when it was let run, for the time limit */
+    double blocked;/* client_blocked_seconds() for its client then */
+    struct Request *request;/* NULL for a snapshot or cancelled search */
+    int cancelled;/* 1 if it is to be freed when the workers are done; the
+                     workers stop running its parts as soon as it is set */
+    struct CacheEntry *fill;/* cache entry to store the results in, or NULL */
+} Search;
+
+/* a query from a client that is being answered */
+typedef struct Request {
+    uint32_t id;/* chosen by the client; always 0 for the line protocol */
+    Search *search;/* NULL once a subscription's initial results are sent */
+    struct Subscription *sub;/* NULL unless the client subscribed */
+    int bulkfd;/* file the results are written to, or -1 */
+    int waiting;/* 1 while its search waits for an expensive search to end */
+    int expensive;/* 1 while its search is counted as expensive */
+    struct timespec started;/* when it was received, for the statistics */
+    struct Request *nextwaiting;/* for the queue of waiting requests */
+    struct ClientBuffer *client;
+    struct Request *next;
+} Request;
+
+/* a request for changes to the results of a query */
+typedef struct Subscription {
+    Request *request;
+    char *prefix;/* the path to search under, with no trailing slash */
+    OutBuffer pending;/* deltas that haven't been passed on yet */
+    int synced;/* 1 once the initial results have all been passed on */
+    struct SubscriptionTerm *term;
+    struct Subscription *next;/* other subscriptions to the same term */
+} Subscription;
+
+/* the subscriptions to one search term, so that each term is only matched
+ * once however many clients are subscribed to it
+ */
+typedef struct SubscriptionTerm {
+    char *term;
+    Subscription *sub;
+    UT_hash_handle hh;/* for the hash table mapping term to subscriptions */
+} SubscriptionTerm;
+
+/* the results of a finished search, for answering the same query again
+ * while nothing under the path it searched has changed
+ */
+typedef struct CacheEntry {
+    char *key;/* the query; see cache_key() */
+    int keylen;
+    char *path;/* the path it searched under */
+    unsigned long gen;/* tree_generation when the search started */
+    OutBuffer results;/* each followed by the search's separator */
+    int limit;/* the most bytes of results worth keeping */
+    uint32_t count;
+    UT_hash_handle hh;/* for the hash table mapping key to CacheEntry */
+} CacheEntry;
+
+/* a change to the tree, as recorded in the journal */
+typedef struct JournalEntry {
+    uint64_t gen;/* generation number of the change */
+    int type;/* JF_CHANGE_* */
+    char *path;
+    char *newpath;/* where the path was renamed to, for JF_CHANGE_RENAME */
+} JournalEntry;
+
+/* the clients connected as one uid, so that the daemon can be shared out
+ * between users rather than between connections
+ */
+typedef struct User {
+    uid_t uid;
+    int nclients;
+    int nrequests;/* queries in progress on all of its clients */
+    int nexpensive;/* expensive searches it has running */
+    unsigned long turn;/* the last pass of the run queue it had a turn in */
+    UT_hash_handle hh;/* for the hash table mapping uid to User */
+} User;
+
+/* the protocols a client can speak */
+enum { PROTO_UNKNOWN, PROTO_LINE, PROTO_BINARY };
+
 /* buffer for data from a client */
 typedef struct ClientBuffer {
     int fd;
+    User *user;/* the user at the other end of the socket */
     char *buf;
     int nbytes;
     int nallocd;
+    OutBuffer out;/* results waiting to be sent to the client */
+    int proto;/* decided by the first byte the client sends */
+    int hello;/* 1 once a binary client has said hello */
+    Request *request;/* the queries being answered, in turn */
+    int fds[MAX_REQUESTS];/* files passed for bulk results, oldest first */
+    int nfds;
+    Request *refine;/* the refinement session's query in progress, if any */
+    char *refineterm;/* the session's latest term and path, if any */
+    char *refinepath;
+    int refineunordered;
+    int nrequests;
+    int readable;/* 1 if there may be more to read from the client */
+    int eof;/* 1 once the client has shut down its end; it is closed once
+               everything it asked for has been sent */
+    int runnable;/* 1 while on the queue of clients with work to do */
+    int closed;/* 1 once it is being freed */
+    int full;/* 1 while its output is full, so its searches wait */
+    struct timespec full_since;/* when it last filled up */
+    double blocked;/* seconds it spent full before that */
+    struct ClientBuffer *prev, *next;/* for the queue of clients */
     UT_hash_handle hh;/* for the hash table mapping fd to ClientBuffer */
 } ClientBuffer;
 
 /* jfindd.c */
 extern int debug_mode;
 extern int quiet_mode;
+extern int unordered_mode;
 extern const char *socket_path;
 
 /* treenode.c */
+extern unsigned long tree_generation;
+extern unsigned long ntreenodes;
+extern unsigned long name_bytes;
+extern unsigned long childarray_bytes;
+
 TreeNode *new_treenode(const char *name);
+int childarray_size(int nallocd);
 void add_child(TreeNode *t, TreeNode *child);
 TreeNode *lookup_treenode(TreeNode *t, char *path, int create);
 void remove_treenode(TreeNode *t);
@@ -79,39 +295,213 @@ char *treenode_name(TreeNode *t);
 void set_treenode_for_wd(int wd, TreeNode *t);
 TreeNode *treenode_for_wd(int wd);
 void free_treenode(TreeNode *t);
+void rename_treenode(TreeNode *t, const char *name);
+void retire(void *p, void (*freefunc)(void *));
+void retire_treenode(TreeNode *t);
+unsigned long hold_treenodes(void);
+void release_treenodes(unsigned long gen);
+
+/* capture.c */
+extern const char *record_path;
+extern int replay_mode;
+
+void start_recording(TreeNode *root);
+void record_indexed(TreeNode *t);
+void record_watch(int wd, TreeNode *t);
+void record_unwatch(int wd);
+void record_expire(int cookie);
+void record_events(const char *buf, int n);
 
 /* dirnode.c */
+extern unsigned long ndirinfos;
+
 DirInfo *new_dirinfo(TreeNode *t);
 void set_dirinfo_for_wd(int wd, DirInfo *d);
 DirInfo *dirinfo_for_wd(int wd);
 void remove_wd(int wd);
+int watch_count(void);
+DirInfo *coldest_watch(void);
 void free_dirinfo(DirInfo *d);
 
 /* index.c */
 typedef int (*TraversalFunc)(const char *);
 
+extern int ndirty;
+extern unsigned long nreindexed;
+
 int isdir(const char *path, int printerror);
-void reindex(TreeNode *node, TreeNode *root);
+void mark_dirty(TreeNode *t);
+void unmark_dirty(TreeNode *t);
+void reindex(TreeNode *root);
 int indexfrom(TreeNode *root, const char *relpath);
+Traversal *new_traversal(TreeNode *root, const char *path);
+Traversal *new_node_traversal(TreeNode *t, const char *parentpath,
+        int descend);
+Traversal *new_range_traversal(ChildArray *a, int lo, int hi,
+        const char *dirpath);
+int traversal_next(Traversal *tr, char **path);
+void free_traversal(Traversal *tr);
 int traverse(TreeNode *root, const char *path, TraversalFunc callback);
 
 /* inotify.c */
 extern int inotify_fd;
+extern int max_watches;
+extern unsigned long inotify_events;
+extern unsigned long inotify_coalesced;
+extern unsigned long inotify_rate;
+extern unsigned long inotify_overflows;
 
 void init_inotify(void);
+void stop_inotify(void);
+int add_watch(TreeNode *t, const char *path);
 void watch_directory(TreeNode *t, const char *path);
+void unwatch_directory(TreeNode *t);
 int handle_inotify_events(TreeNode *root);
+int replay_events(TreeNode *root, const char *buf, int n);
+void _inotify_create(TreeNode *root, TreeNode *parent,
+        struct inotify_event *ev);
+void _inotify_delete(TreeNode *root, TreeNode *parent,
+        struct inotify_event *ev);
 
 /* nodemove.c */
+extern int nmoves;
+extern unsigned long moves_paired;
+extern unsigned long moves_expired;
+
 NodeMove *new_nodemove(void);
 void set_node_moved_from(int cookie, TreeNode *t);
-TreeNode *node_for_cookie(int cookie);
+TreeNode *node_for_cookie(int cookie, char **path);
+TreeNode *moving_ancestor(TreeNode *t);
+void expire_move_for_cookie(int cookie);
+void expire_moves(void);
+int move_timeout(void);
+void forget_moves(void);
+
+/* poller.c */
+extern int npolled;
+extern unsigned long poller_rescans;
+extern unsigned long poller_promotions;
+extern unsigned long poller_demotions;
+
+void poll_directory(TreeNode *t, const char *path, int pseudo);
+void unpoll_directory(DirInfo *d);
+void poll_unwatched(TreeNode *t);
+int rescan_directory(TreeNode *root, TreeNode *t, const char *path);
+void step_poller(TreeNode *root);
+int poller_timeout(void);
+
+/* reader.c */
+extern unsigned long inotify_stalls;
+extern unsigned long inotify_peak;
+
+void start_reader(void);
+void stop_reader(void);
+int reader_fd(void);
+unsigned long reader_backlog(void);
+int take_events(char *buf, int size);
 
 /* socket.c */
 void run(TreeNode *root, const char *sockpath);
+void schedule_client(ClientBuffer *c);
 ClientBuffer *new_clientbuffer(int fd);
 void clear_clientbuffer(int fd);
-int handle_client_data(TreeNode *root, int fd);
+void send_client_output(ClientBuffer *c);
+Request *new_request(ClientBuffer *c, uint32_t id, Search *s);
+void end_request(Request *r);
+void handle_worker_events(void);
+int take_client_fd(ClientBuffer *c);
+int client_count(void);
+unsigned long client_bytes(void);
+double client_blocked_seconds(ClientBuffer *c);
+
+/* protocol.c */
+int begin_frame(OutBuffer *o);
+void end_frame(OutBuffer *o, int frame, int type, int status, uint32_t id);
+void append_frame(OutBuffer *o, int type, int status, uint32_t id,
+        const void *payload, int length);
+void append_done(OutBuffer *o, uint32_t id, int status, uint32_t count,
+        const char *msg);
+int frame_ready(ClientBuffer *c);
+int frame_startable(ClientBuffer *c);
+int handle_frames(TreeNode *root, ClientBuffer *c);
+void step_binary_request(Request *r);
+
+/* subscribe.c */
+Subscription *subscribe(Request *r, const char *term, const char *path);
+void unsubscribe(Subscription *s);
+void sync_subscription(Subscription *s);
+void notify_added(TreeNode *t);
+void notify_removed(TreeNode *t);
+void flush_subscriptions(void);
+
+/* users.c */
+User *add_user_client(uid_t uid);
+void remove_user_client(User *u);
+int user_may_query(User *u);
+void admit_request(Request *r);
+void release_request(Request *r);
+const char *request_over_budget(Request *r);
+int user_count(void);
+
+/* cache.c */
+extern unsigned long cache_hits;
+extern unsigned long cache_misses;
+extern long cache_bytes;
+
+CacheEntry *cache_lookup(TreeNode *root, const char *path, const char *term,
+        int unordered, char sep);
+CacheEntry *cache_refine(TreeNode *root, const char *path,
+        const char *oldterm, const char *term, int unordered, char sep);
+void cache_fill(Search *s, const char *path, int limit);
+void cache_store(Search *s);
+void free_cacheentry(CacheEntry *e);
+void clear_cache(void);
+
+/* journal.c */
+extern uint64_t journal_generation;
+extern unsigned long journal_bytes;
+
+void start_journal(void);
+void stop_journal(void);
+void journal_change(int type, const char *path, const char *newpath);
+void journal_node(int type, TreeNode *t);
+int journal_covers(uint64_t gen);
+JournalEntry *journal_entry(uint64_t gen);
+
+/* snapshot.c */
+extern int snapshot_mode;
+
+void step_snapshot(TreeNode *root);
+int snapshot_timeout(void);
+void stop_snapshot(void);
+
+/* search.c */
+void append_outbuffer(OutBuffer *o, const char *buf, int nbytes);
+int outbuffer_full(OutBuffer *o);
+Search *new_search(TreeNode *root, const char *path, const char *term,
+        int unordered, char sep);
+void free_search(Search *s);
+void run_search_part(SearchPart *p, int budget);
+int search_finished(Search *s);
+int search_runnable(Search *s, OutBuffer *out);
+int search_step(Search *s, OutBuffer *out);
+int search_results(Search *s);
+
+/* stats.c */
+double seconds_since(const struct timespec *start);
+void count_query(Request *r);
+void count_reindex(double secs);
+void count_index(double secs);
+void append_stats(TreeNode *root, OutBuffer *o);
+
+/* workers.c */
+extern int nworkers;
+
+void init_workers(int n);
+int worker_fd(void);
+int workers_busy(void);
+void submit_work(SearchPart *p);
+SearchPart *finished_work(void);
 
 /* string.c */
 char *strallocat(const char *s1, ...);
@@ -0,0 +1,109 @@
+/* Change journal for jfindd
+ *
+ * The inotify handlers record every create, delete and rename in a ring
+ * buffer of the last JOURNAL_SIZE changes. Each change gets the next
+ * generation number, so a client that remembers the latest generation it has
+ * seen can ask what has changed since, as long as the journal still goes back
+ * that far.
+ *
+ * James Stanley 2012
+ */
+
+#include "jfindd.h"
+
+uint64_t journal_generation;/* generation of the latest change */
+unsigned long journal_bytes = sizeof(JournalEntry) * JOURNAL_SIZE;
+
+static JournalEntry journal[JOURNAL_SIZE];
+static int first;/* index of the oldest entry */
+static int nentries;
+static int recording;/* 1 while changes are being recorded */
+
+/* free the paths of the entry */
+static void forget_entry(JournalEntry *e) {
+    journal_bytes -= strlen(e->path) + 1;
+    if(e->newpath)
+        journal_bytes -= strlen(e->newpath) + 1;
+
+    free(e->path);
+    free(e->newpath);
+}
+
+/* start recording changes to a freshly-indexed tree; nothing from before
+ * this can be asked for
+ */
+void start_journal(void) {
+    struct timeval tv;
+
+    /* generations start from the time in microseconds, so that any a client
+     * has left over from an earlier run of the daemon are too old
+     */
+    gettimeofday(&tv, NULL);
+    uint64_t now = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    if(journal_generation < now)
+        journal_generation = now;
+
+    recording = 1;
+}
+
+/* stop recording changes and forget the ones that have been recorded */
+void stop_journal(void) {
+    while(nentries) {
+        forget_entry(journal + first);
+        first = (first + 1) % JOURNAL_SIZE;
+        nentries--;
+    }
+
+    recording = 0;
+}
+
+/* record a change of the given type (JF_CHANGE_*) to the path; newpath is
+ * only for renames and is NULL otherwise
+ */
+void journal_change(int type, const char *path, const char *newpath) {
+    if(!recording)
+        return;
+
+    /* make room by forgetting the oldest change */
+    if(nentries == JOURNAL_SIZE) {
+        forget_entry(journal + first);
+        first = (first + 1) % JOURNAL_SIZE;
+        nentries--;
+    }
+
+    JournalEntry *e = &journal[(first + nentries++) % JOURNAL_SIZE];
+    e->gen = ++journal_generation;
+    e->type = type;
+    e->path = strdup(path);
+    e->newpath = newpath ? strdup(newpath) : NULL;
+
+    journal_bytes += strlen(path) + 1;
+    if(newpath)
+        journal_bytes += strlen(newpath) + 1;
+}
+
+/* record a change of the given type to the path of the node */
+void journal_node(int type, TreeNode *t) {
+    if(!recording)
+        return;
+
+    char *path = treenode_name(t);
+    journal_change(type, path, NULL);
+    free(path);
+}
+
+/* return 1 if every change since the given generation is in the journal and
+ * 0 otherwise
+ */
+int journal_covers(uint64_t gen) {
+    return gen <= journal_generation && gen >= journal_generation - nentries;
+}
+
+/* return the change with the given generation, which must be in the journal */
+JournalEntry *journal_entry(uint64_t gen) {
+    assert(gen > journal_generation - nentries && gen <= journal_generation);
+
+    /* generations are consecutive, so the newest is nentries-1 after first */
+    return &journal[(first + nentries - 1 - (journal_generation - gen))
+        % JOURNAL_SIZE];
+}
@@ -1,4 +1,14 @@
 /* Handle node moves (renames) for jfindd
+ *
+ * inotify reports a rename as an IN_MOVED_FROM in the old directory and an
+ * IN_MOVED_TO in the new one, with the same cookie. The node is taken out of
+ * the tree at the IN_MOVED_FROM and put back at the IN_MOVED_TO, so a moved
+ * directory keeps everything below it, watches and all, however big it is.
+ *
+ * If the IN_MOVED_TO never comes, because the node was moved out of the
+ * indexed tree, the move is given up on after MOVE_TIMEOUT milliseconds and
+ * handled as a delete. An IN_MOVED_TO without an IN_MOVED_FROM, for a node
+ * moved in from outside, is handled as a create (see _inotify_moved_to()).
  *
  * James Stanley 2012
  */
@@ -7,6 +17,19 @@
 
 static NodeMove *move_hash;
 
+int nmoves;/* moves waiting for their IN_MOVED_TO */
+unsigned long moves_paired;/* moves within the tree */
+unsigned long moves_expired;/* moves out of the tree, handled as deletes */
+
+/* return the time in milliseconds from an arbitrary starting point */
+static long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /* allocate and return a new NodeMove */
 NodeMove *new_nodemove(void) {
     NodeMove *m = malloc(sizeof(NodeMove));
@@ -16,33 +39,167 @@ NodeMove *new_nodemove(void) {
     return m;
 }
 
-/* remember the node corresponding to the given cookie so that it can be
- * renamed later
+/* forget about the move and free the NodeMove, but not the node */
+static void forget_move(NodeMove *m) {
+    m->node->moving = 0;
+
+    HASH_DEL(move_hash, m);
+    nmoves--;
+
+    free(m->path);
+    free(m);
+}
+
+/* remove the watches from every directory from t down, since they are now
+ * outside the tree
+ */
+static void unwatch_subtree(TreeNode *t) {
+    if(!t->dir)
+        return;
+
+    int wd = t->dir->wd;
+    if(wd != -1) {
+        remove_wd(wd);
+        inotify_rm_watch(inotify_fd, wd);
+    }
+
+    ChildArray *a = t->dir->children;
+    int i;
+    for(i = 0; a && i < a->nchilds; i++)
+        if(a->child[i])
+            unwatch_subtree(a->child[i]);
+}
+
+/* handle the move, whose IN_MOVED_TO isn't coming, as a delete */
+static void expire_move(NodeMove *m) {
+    TreeNode *t = m->node;
+
+    journal_change(JF_CHANGE_DELETE, m->path, NULL);
+
+    unwatch_subtree(t);
+    forget_move(m);
+    retire_treenode(t);
+
+    moves_expired++;
+}
+
+/* take the node out of the tree until the IN_MOVED_TO with the given cookie
+ * puts it back, or the move expires
  */
 void set_node_moved_from(int cookie, TreeNode *t) {
-    NodeMove *m = new_nodemove();
+    NodeMove *m;
 
+    /* a cookie is only used once (until they wrap around) */
+    HASH_FIND_INT(move_hash, &cookie, m);
+    if(m)
+        expire_move(m);
+
+    m = new_nodemove();
     m->cookie = cookie;
     m->node = t;
+    m->path = treenode_name(t);
+    m->when = now_ms();
+
+    remove_treenode(t);
+    t->moving = 1;
 
     HASH_ADD_INT(move_hash, cookie, m);
+    nmoves++;
 }
 
-/* return the TreeNode associated with the given cookie, and then forget the
- * association and free the NodeMove (!)
+/* return the node taken out of the tree for the given cookie and forget the
+ * move, setting *path to where it was (which must be freed), or return NULL
+ * if there is no such move
  */
-TreeNode *node_for_cookie(int cookie) {
+TreeNode *node_for_cookie(int cookie, char **path) {
     NodeMove *m;
-    TreeNode *t;
 
     HASH_FIND_INT(move_hash, &cookie, m);
+    if(!m)
+        return NULL;
 
-    assert(m);/* the NodeMove must be in the hash */
+    TreeNode *t = m->node;
+    *path = m->path;
+    m->path = NULL;
 
-    t = m->node;
-
-    HASH_DEL(move_hash, m);
-    free(m);
+    forget_move(m);
+    moves_paired++;
 
     return t;
 }
+
+/* return the node waiting for its IN_MOVED_TO that t is at or below, or NULL
+ * if t is not in a node that is being moved
+ */
+TreeNode *moving_ancestor(TreeNode *t) {
+    while(t->parent)
+        t = t->parent;
+
+    return t->moving ? t : NULL;
+}
+
+/* expire the move with the given cookie, if there is one, as if its
+ * IN_MOVED_TO hadn't come in time
+ */
+void expire_move_for_cookie(int cookie) {
+    NodeMove *m;
+
+    HASH_FIND_INT(move_hash, &cookie, m);
+    if(m)
+        expire_move(m);
+}
+
+/* handle the moves whose IN_MOVED_TO hasn't come in time as deletes; a move
+ * only expires once every event read so far has been handled, in case its
+ * IN_MOVED_TO is among them
+ */
+void expire_moves(void) {
+    if(!nmoves || reader_backlog())
+        return;
+
+    long now = now_ms();
+    int n = 0;
+
+    NodeMove *m, *tmp;
+    HASH_ITER(hh, move_hash, m, tmp) {
+        if(now - m->when >= MOVE_TIMEOUT) {
+            record_expire(m->cookie);
+            expire_move(m);
+            n++;
+        }
+    }
+
+    /* tell subscribers about the changes */
+    if(n)
+        flush_subscriptions();
+}
+
+/* return the number of milliseconds the main loop can wait for events before
+ * a move needs to be expired, or -1 if it can wait forever
+ */
+int move_timeout(void) {
+    if(!nmoves)
+        return -1;
+
+    long oldest = LONG_MAX;
+    NodeMove *m, *tmp;
+    HASH_ITER(hh, move_hash, m, tmp)
+        if(m->when < oldest)
+            oldest = m->when;
+
+    long wait = oldest + MOVE_TIMEOUT - now_ms();
+    return wait > 0 ? wait : 0;
+}
+
+/* free the nodes waiting for their IN_MOVED_TO, because the tree is going
+ * away
+ */
+void forget_moves(void) {
+    NodeMove *m, *tmp;
+
+    HASH_ITER(hh, move_hash, m, tmp) {
+        TreeNode *t = m->node;
+        forget_move(m);
+        free_treenode(t);
+    }
+}
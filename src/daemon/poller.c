@@ -0,0 +1,341 @@
+/* Poll directories that aren't watched by inotify for jfindd
+ *
+ * There are only so many inotify watches to go round, and inotify doesn't
+ * notice changes to pseudo-filesystems like /proc at all, so directories that
+ * can't be watched are polled instead: each is checked every so often, and if
+ * it has changed it is read again and compared with the tree, and the
+ * differences are handled as if inotify had reported them.
+ *
+ * A directory is checked after POLL_MIN_INTERVAL seconds, and the interval
+ * doubles every time it hasn't changed, up to POLL_MAX_INTERVAL. Only its
+ * mtime is looked at unless it is on a pseudo-filesystem, whose mtimes don't
+ * change. A directory that keeps changing is given a watch when one is free,
+ * or the watch of the directory that has gone longest without an event.
+ *
+ * James Stanley 2012
+ */
+
+#include "jfindd.h"
+
+int npolled;
+unsigned long poller_rescans;/* directories read again because they changed */
+unsigned long poller_promotions;/* polled directories given a watch */
+unsigned long poller_demotions;/* watched directories moved to polling */
+
+static PollState **heap;/* polled directories, soonest to check first */
+static int nallocd;
+
+/* swap the two entries in the heap */
+static void heap_swap(int i, int j) {
+    PollState *p = heap[i];
+
+    heap[i] = heap[j];
+    heap[j] = p;
+    heap[i]->heapidx = i;
+    heap[j]->heapidx = j;
+}
+
+/* move the entry at i to where it belongs in the heap */
+static void heap_fix(int i) {
+    while(i && heap[i]->next < heap[(i - 1) / 2]->next) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    while(1) {
+        int child = 2 * i + 1;
+        if(child >= npolled)
+            break;
+        if(child + 1 < npolled && heap[child + 1]->next < heap[child]->next)
+            child++;
+        if(heap[i]->next <= heap[child]->next)
+            break;
+        heap_swap(i, child);
+        i = child;
+    }
+}
+
+/* start polling the node's directory, first checking it after "wait"
+ * seconds; if mtime is NULL, it is read again then whether it has changed or
+ * not
+ */
+static void add_poll(TreeNode *t, int pseudo, struct timespec *mtime,
+        int wait) {
+    assert(t->dir && !t->dir->poll);
+
+    PollState *p = malloc(sizeof(PollState));
+    memset(p, 0, sizeof(PollState));
+    p->d = t->dir;
+    p->pseudo = pseudo;
+    p->interval = POLL_MIN_INTERVAL;
+    p->next = time(NULL) + wait;
+    if(mtime)
+        p->mtime = *mtime;
+    t->dir->poll = p;
+
+    if(npolled == nallocd) {
+        nallocd = nallocd ? nallocd * 2 : 64;
+        heap = realloc(heap, nallocd * sizeof(PollState *));
+    }
+    p->heapidx = npolled;
+    heap[npolled++] = p;
+    heap_fix(p->heapidx);
+}
+
+/* poll the node's directory, at path, instead of watching it; pseudo is 1 if
+ * it is on a filesystem whose mtimes don't change
+ * this is called before the directory is read, so anything that changes
+ * after that is noticed
+ */
+void poll_directory(TreeNode *t, const char *path, int pseudo) {
+    struct stat st;
+
+    if(t->dir->poll)
+        return;
+
+    if(stat(path, &st) == -1)
+        memset(&st, 0, sizeof(st));
+
+    add_poll(t, pseudo, &st.st_mtim, POLL_MIN_INTERVAL);
+}
+
+/* stop polling the directory, which is being freed or given a watch */
+void unpoll_directory(DirInfo *d) {
+    PollState *p = d->poll;
+
+    if(!p)
+        return;
+
+    int i = p->heapidx;
+    if(i != --npolled) {
+        heap_swap(i, npolled);
+        heap_fix(i);
+    }
+
+    d->poll = NULL;
+    free(p);
+}
+
+/* handle a change of the given type (IN_CREATE or IN_DELETE) to the name in
+ * the node's directory as if inotify had reported it
+ */
+static void fake_event(TreeNode *root, TreeNode *t, int mask,
+        const char *name) {
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+    struct inotify_event *ev = (struct inotify_event *)buf;
+
+    memset(ev, 0, sizeof(struct inotify_event));
+    ev->wd = -1;
+    ev->mask = mask;
+    ev->len = strlen(name) + 1;
+    strcpy(ev->name, name);
+
+    if(mask & IN_CREATE)
+        _inotify_create(root, t, ev);
+    else
+        _inotify_delete(root, t, ev);
+}
+
+/* a child of a directory being read again, and whether it is still there */
+typedef struct SeenChild {
+    TreeNode *t;
+    int seen;
+    UT_hash_handle hh;/* for the hash table mapping name to SeenChild */
+} SeenChild;
+
+/* read the node's directory, at path, again and handle whatever has been
+ * created or deleted since the tree was last brought up to date with it
+ * return the number of changes, or -1 if the directory can't be read
+ */
+int rescan_directory(TreeNode *root, TreeNode *t, const char *path) {
+    DIR *dp;
+
+    if(!(dp = opendir(path)))
+        return -1;
+
+    /* index the children by name; children added from here on are new, so
+     * needn't be looked for
+     */
+    ChildArray *a = t->dir->children;
+    int nchilds = a ? a->nchilds : 0;
+    SeenChild *child = malloc((nchilds + 1) * sizeof(SeenChild));
+    SeenChild *names = NULL;
+    int n = 0;
+    int i;
+    for(i = 0; i < nchilds; i++) {
+        if(!a->child[i])
+            continue;
+        child[n].t = a->child[i];
+        child[n].seen = 0;
+        HASH_ADD_KEYPTR(hh, names, a->child[i]->name,
+                strlen(a->child[i]->name), child + n);
+        n++;
+    }
+
+    int changes = 0;
+    struct dirent *de;
+    while((de = readdir(dp))) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        SeenChild *c;
+        HASH_FIND_STR(names, de->d_name, c);
+        if(c) {
+            c->seen = 1;
+
+            /* it may have been replaced with something of a different
+             * type
+             */
+            if(de->d_type == DT_UNKNOWN
+                    || (de->d_type == DT_DIR) == (c->t->dir != NULL))
+                continue;
+            HASH_DEL(names, c);
+            fake_event(root, t, IN_DELETE, de->d_name);
+            changes++;
+        }
+
+        fake_event(root, t, IN_CREATE, de->d_name);
+        changes++;
+    }
+
+    closedir(dp);
+
+    /* anything that wasn't seen has gone */
+    SeenChild *c, *tmp;
+    HASH_ITER(hh, names, c, tmp) {
+        if(c->seen)
+            continue;
+        char name[NAME_MAX + 1];
+        snprintf(name, sizeof(name), "%s", c->t->name);
+        fake_event(root, t, IN_DELETE, name);
+        changes++;
+    }
+
+    HASH_CLEAR(hh, names);
+    free(child);
+
+    return changes;
+}
+
+/* stop polling the directory, at path, and watch it instead, moving the
+ * watch of the directory that has gone longest without an event to polling
+ * if there are none to spare
+ * return 0 on success and -1 on failure
+ */
+static int promote(PollState *p, const char *path, time_t now) {
+    static time_t lastdemotion;
+
+    if(watch_count() >= max_watches) {
+        /* don't give up a watch that is in use, or more than one a second */
+        if(now == lastdemotion)
+            return -1;
+        DirInfo *cold = coldest_watch();
+        if(!cold || cold->active > now - POLL_MAX_INTERVAL)
+            return -1;
+
+        lastdemotion = now;
+        unwatch_directory(cold->t);
+        poller_demotions++;
+    }
+
+    if(add_watch(p->d->t, path) == -1)
+        return -1;
+    record_watch(p->d->wd, p->d->t);
+
+    poller_promotions++;
+    return 0;
+}
+
+/* check the polled directory, which is due, and arrange when to check it
+ * next
+ */
+static void check_directory(TreeNode *root, PollState *p, time_t now) {
+    TreeNode *t = p->d->t;
+    struct stat st;
+
+    /* it has no path while it is being moved */
+    if(nmoves && moving_ancestor(t)) {
+        p->next = now + p->interval;
+        heap_fix(p->heapidx);
+        return;
+    }
+
+    char *path = treenode_name(t);
+
+    /* directories that keep changing are worth watching; anything changed
+     * before the watch is added is noticed by reading it again
+     */
+    if(!p->pseudo && p->busy >= POLL_PROMOTE_AFTER
+            && promote(p, path, now) == 0) {
+        unpoll_directory(p->d);
+        poller_rescans++;
+        rescan_directory(root, t, path);
+        free(path);
+        return;
+    }
+
+    int changes = 0;
+    if(stat(path, &st) == 0) {
+        if(p->pseudo || st.st_mtim.tv_sec != p->mtime.tv_sec
+                || st.st_mtim.tv_nsec != p->mtime.tv_nsec) {
+            p->mtime = st.st_mtim;
+            poller_rescans++;
+            changes = rescan_directory(root, t, path);
+            if(changes > 0)
+                record_indexed(t);
+        }
+    }
+    free(path);
+
+    if(changes > 0) {
+        p->busy++;
+        p->interval = POLL_MIN_INTERVAL;
+    } else {
+        p->busy = 0;
+        p->interval *= 2;
+        if(p->interval > POLL_MAX_INTERVAL)
+            p->interval = POLL_MAX_INTERVAL;
+    }
+
+    p->next = now + p->interval;
+    heap_fix(p->heapidx);
+}
+
+/* check up to POLL_BATCH of the polled directories that are due, and bring
+ * the tree up to date with them
+ */
+void step_poller(TreeNode *root) {
+    time_t now = time(NULL);
+    int n = 0;
+
+    while(npolled && heap[0]->next <= now && n++ < POLL_BATCH)
+        check_directory(root, heap[0], now);
+
+    if(!n)
+        return;
+
+    /* index the directories that have appeared */
+    reindex(root);
+
+    /* tell subscribers about the changes */
+    flush_subscriptions();
+}
+
+/* return the number of milliseconds the main loop can wait for events before
+ * step_poller() has something to do, or -1 if it can wait forever
+ */
+int poller_timeout(void) {
+    if(!npolled)
+        return -1;
+
+    time_t wait = heap[0]->next - time(NULL);
+    return wait > 0 ? wait * 1000 : 0;
+}
+
+/* poll the node's directory, whose watch has just been removed; it is read
+ * again straight away, since inotify may not have told us about everything
+ * that happened before the watch was removed
+ */
+void poll_unwatched(TreeNode *t) {
+    add_poll(t, 0, NULL, 0);
+}
@@ -0,0 +1,65 @@
+/* Static tracepoints for jfindd
+ *
+ * Where <sys/sdt.h> is available (systemtap-sdt-dev on Debian), each PROBEn()
+ * is a USDT probe in the "jfindd" provider: a single nop in the code, with a
+ * note in the binary that tells bpftrace, perf or SystemTap where it is and
+ * how to find its arguments, so it costs nothing until something attaches to
+ * it. Without <sys/sdt.h>, or with -DNO_PROBES, they compile to nothing.
+ * Arguments must be integers or pointers, and cheap to compute, since they
+ * are computed whether or not anything is attached.
+ *
+ * The probes, and their arguments:
+ *  index_dir_start(path)             _indexfs() starts on a directory
+ *  index_dir_end(path, nentries)     ...and has finished it, including the
+ *                                    directories below (-1 if it couldn't be
+ *                                    opened)
+ *  reindex_start(nqueued)            reindex() starts a pass
+ *  reindex_end(ntried, nqueued)      ...and has finished it
+ *  inotify_batch_start(nevents)      a batch of events has been coalesced
+ *  inotify_event(wd, mask, cookie, name)
+ *                                    an event is about to be handled
+ *  inotify_event_done(wd, mask)      ...and has been
+ *  inotify_event_dropped(wd, mask)   an event was coalesced away
+ *  inotify_batch_end(nevents, ndropped)
+ *                                    the batch, and the reindexing and
+ *                                    subscription updates after it, are done
+ *  query_start(search, term, nnodes) a search starts for a client
+ *  query_match(search, path)         a path matches (in a worker thread)
+ *  query_end(search, nresults, nvisited)
+ *                                    the search has finished or been given up
+ *  query_cached(term)                a query was answered from the cache
+ *  search_slice_start(search)        a slice of a search starts running
+ *  search_slice_end(search, nvisited)
+ *                                    ...and has stopped
+ * The search pointer identifies the search from start to end.
+ *
+ * See src/probes/ for bpftrace scripts that use them.
+ *
+ * James Stanley 2012
+ */
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(jfindd, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(jfindd, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(jfindd, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(jfindd, name, a, b, c, d)
+#else
+/* the arguments are still checked, so that a build without probes catches
+ * mistakes in them too (and doesn't warn about variables kept only for them)
+ */
+#define PROBE1(name, a) \
+    do { if(0) { (void)(a); } } while(0)
+#define PROBE2(name, a, b) \
+    do { if(0) { (void)(a); (void)(b); } } while(0)
+#define PROBE3(name, a, b, c) \
+    do { if(0) { (void)(a); (void)(b); (void)(c); } } while(0)
+#define PROBE4(name, a, b, c, d) \
+    do { if(0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while(0)
+#endif
@@ -0,0 +1,544 @@
+/* Binary protocol handling for jfindd (see protocol.h)
+ *
+ * James Stanley 2012
+ */
+
+#include "jfindd.h"
+
+static OutBuffer bulk;/* results on their way to a request's bulk file */
+
+/* read a big-endian uint16 from p */
+static int get16(const char *p) {
+    uint16_t n;
+    memcpy(&n, p, 2);
+    return ntohs(n);
+}
+
+/* read a big-endian uint32 from p */
+static uint32_t get32(const char *p) {
+    uint32_t n;
+    memcpy(&n, p, 4);
+    return ntohl(n);
+}
+
+/* read a big-endian uint64 from p */
+static uint64_t get64(const char *p) {
+    return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+/* write n to p as a big-endian uint16 */
+static void put16(char *p, int n) {
+    uint16_t v = htons(n);
+    memcpy(p, &v, 2);
+}
+
+/* write n to p as a big-endian uint32 */
+static void put32(char *p, uint32_t n) {
+    uint32_t v = htonl(n);
+    memcpy(p, &v, 4);
+}
+
+/* write n to p as a big-endian uint64 */
+static void put64(char *p, uint64_t n) {
+    put32(p, n >> 32);
+    put32(p + 4, n);
+}
+
+/* reserve space for a frame header at the end of the OutBuffer, so that the
+ * payload can be appended directly; returns the position of the frame to
+ * give to end_frame()
+ */
+int begin_frame(OutBuffer *o) {
+    char header[JF_HEADER_SIZE];
+
+    memset(header, 0, JF_HEADER_SIZE);
+    append_outbuffer(o, header, JF_HEADER_SIZE);
+
+    /* this is relative to the unsent data, which append_outbuffer() may move
+     * but never reorders
+     */
+    return o->nbytes - o->start - JF_HEADER_SIZE;
+}
+
+/* fill in the header of the frame started by begin_frame() now that its
+ * payload has been appended, or remove it again if it has no payload
+ */
+void end_frame(OutBuffer *o, int frame, int type, int status, uint32_t id) {
+    char *header = o->buf + o->start + frame;
+    int length = o->nbytes - o->start - frame - JF_HEADER_SIZE;
+
+    if(length == 0) {
+        o->nbytes -= JF_HEADER_SIZE;
+        return;
+    }
+
+    put32(header, length);
+    put16(header + 4, type);
+    put16(header + 6, status);
+    put32(header + 8, id);
+}
+
+/* append a whole frame to the OutBuffer */
+void append_frame(OutBuffer *o, int type, int status, uint32_t id,
+        const void *payload, int length) {
+    int frame = begin_frame(o);
+    append_outbuffer(o, payload, length);
+    end_frame(o, frame, type, status, id);
+}
+
+/* append a JF_MSG_DONE frame to the OutBuffer; msg may be NULL */
+void append_done(OutBuffer *o, uint32_t id, int status, uint32_t count,
+        const char *msg) {
+    char buf[4];
+    int frame = begin_frame(o);
+
+    put32(buf, count);
+    append_outbuffer(o, buf, 4);
+    if(msg)
+        append_outbuffer(o, msg, strlen(msg));
+
+    end_frame(o, frame, JF_MSG_DONE, status, id);
+}
+
+/* append the n bytes of results in buf, each followed by sep, to the
+ * OutBuffer as JF_MSG_RESULTS frames of at most OUTBUF_SIZE bytes, without
+ * splitting any result
+ */
+static void append_results(OutBuffer *o, uint32_t id, const char *buf, int n,
+        char sep) {
+    int start, end;
+
+    for(start = 0; start < n; start = end) {
+        end = n;
+        if(n - start > OUTBUF_SIZE) {
+            end = start + OUTBUF_SIZE;
+            while(end > start && buf[end - 1] != sep)
+                end--;
+            if(end == start)
+                end = start + OUTBUF_SIZE;
+        }
+
+        append_frame(o, JF_MSG_RESULTS, JF_STATUS_OK, id, buf + start,
+                end - start);
+    }
+}
+
+/* append a JF_MSG_GENERATION frame with the generation of the latest change
+ * to the OutBuffer
+ */
+static void append_generation(OutBuffer *o, uint32_t id) {
+    char buf[8];
+
+    put64(buf, journal_generation);
+    append_frame(o, JF_MSG_GENERATION, JF_STATUS_OK, id, buf, 8);
+}
+
+/* return 1 if the client's buffer holds a whole frame (or the header of one
+ * that is too big to accept) and 0 otherwise
+ */
+int frame_ready(ClientBuffer *c) {
+    if(c->nbytes < JF_HEADER_SIZE)
+        return 0;
+
+    uint32_t length = get32(c->buf);
+
+    return length > JF_MAX_FRAME || c->nbytes >= JF_HEADER_SIZE + length;
+}
+
+/* return 1 if the client's buffer holds a whole message that can be handled
+ * now, and 0 otherwise: other messages wait while the client has as many
+ * queries in flight as it may have or a full output queue, but a
+ * cancellation never waits
+ */
+int frame_startable(ClientBuffer *c) {
+    if(!frame_ready(c))
+        return 0;
+
+    if(get32(c->buf) <= JF_MAX_FRAME && get16(c->buf + 4) == JF_MSG_CANCEL)
+        return 1;
+
+    return c->nrequests < MAX_REQUESTS && user_may_query(c->user)
+        && !outbuffer_full(&c->out);
+}
+
+/* reply to a JF_MSG_HELLO from the client */
+static void handle_hello(ClientBuffer *c, const char *payload, int length) {
+    char buf[4];
+    int status = JF_STATUS_OK;
+
+    if(length != 4 || get32(payload) != JF_VERSION)
+        status = JF_STATUS_BAD_VERSION;
+
+    c->hello = (status == JF_STATUS_OK);
+
+    put32(buf, JF_VERSION);
+    append_frame(&c->out, JF_MSG_HELLO, status, 0, buf, 4);
+}
+
+/* start the search asked for by a JF_MSG_QUERY with the given id, or reply
+ * straight away with an error
+ */
+static void handle_query(TreeNode *root, ClientBuffer *c, uint32_t id,
+        const char *payload, int length) {
+    char *term = NULL;
+    char *path = NULL;
+    int unordered = unordered_mode;
+    int subscribed = 0;
+    int bulkfd = -1;
+    int refine = 0;
+    char sep = '\0';
+    const char *error = NULL;
+    int p = 0;
+
+    if(!c->hello) {
+        append_done(&c->out, id, JF_STATUS_BAD_VERSION, 0,
+                "no protocol version agreed");
+        return;
+    }
+
+    /* read the options */
+    while(!error && p < length) {
+        if(length - p < 4) {
+            error = "truncated option";
+            break;
+        }
+
+        int opt = get16(payload + p);
+        int len = get16(payload + p + 2);
+        p += 4;
+
+        if(len > length - p) {
+            error = "truncated option";
+            break;
+        }
+
+        switch(opt) {
+            case JF_OPT_TERM:
+                free(term);
+                term = strndup(payload + p, len);
+                break;
+
+            case JF_OPT_PATH:
+                free(path);
+                path = strndup(payload + p, len);
+                break;
+
+            case JF_OPT_UNORDERED:
+                if(len != 1)
+                    error = "bad value for unordered option";
+                else
+                    unordered = payload[p];
+                break;
+
+            case JF_OPT_SUBSCRIBE:
+                if(len != 1)
+                    error = "bad value for subscribe option";
+                else
+                    subscribed = payload[p];
+                break;
+
+            case JF_OPT_BULK:
+                if(len != 1) {
+                    error = "bad value for bulk option";
+                } else if(bulkfd == -1) {
+                    sep = payload[p];
+                    if((bulkfd = take_client_fd(c)) == -1)
+                        error = "no file passed for bulk results";
+                }
+                break;
+
+            case JF_OPT_REFINE:
+                if(len != 1)
+                    error = "bad value for refine option";
+                else
+                    refine = payload[p];
+                break;
+
+            default:
+                error = "unknown option";
+                break;
+        }
+
+        p += len;
+    }
+
+    if(!error && !term)
+        error = "no search term";
+    if(!path)
+        path = strdup("/");
+    if(!error && refine && (subscribed || bulkfd != -1))
+        error = "only plain queries can be refined";
+
+    /* writing to anything other than a regular file could block */
+    struct stat st;
+    if(!error && bulkfd != -1
+            && (fstat(bulkfd, &st) == -1 || !S_ISREG(st.st_mode)))
+        error = "bulk results need a regular file";
+
+    /* a newer query in a refinement session replaces the last one */
+    if(refine && c->refine) {
+        append_done(&c->out, c->refine->id, JF_STATUS_CANCELLED, 0,
+                "replaced by a newer query");
+        end_request(c->refine);
+    }
+
+    /* plain queries can be answered from the cache, and in a refinement
+     * session from the last query's results if the term has only grown
+     */
+    CacheEntry *e = NULL;
+    if(!error && refine && c->refineterm && strstr(term, c->refineterm)
+            && strcmp(path, c->refinepath) == 0
+            && unordered == c->refineunordered)
+        e = cache_refine(root, path, c->refineterm, term, unordered, sep);
+    if(!error && !e && !subscribed && bulkfd == -1)
+        e = cache_lookup(root, path, term, unordered, sep);
+
+    if(!error && refine) {
+        free(c->refineterm);
+        free(c->refinepath);
+        c->refineterm = strdup(term);
+        c->refinepath = strdup(path);
+        c->refineunordered = unordered;
+    }
+
+    /* start the search */
+    if(error) {
+        append_done(&c->out, id, JF_STATUS_BAD_REQUEST, 0, error);
+    } else if(e) {
+        append_generation(&c->out, id);
+        append_results(&c->out, id, e->results.buf, e->results.nbytes, sep);
+        append_done(&c->out, id, JF_STATUS_OK, e->count, NULL);
+    } else {
+        Search *s = new_search(root, path, term, unordered, sep);
+        if(s) {
+            append_generation(&c->out, id);
+            Request *r = new_request(c, id, s);
+            if(subscribed)
+                r->sub = subscribe(r, term, path);
+            else if(bulkfd == -1)
+                cache_fill(s, path,
+                        refine ? REFINE_ENTRY_SIZE : CACHE_ENTRY_SIZE);
+            if(refine)
+                c->refine = r;
+            r->bulkfd = bulkfd;
+            bulkfd = -1;
+        } else
+            append_done(&c->out, id, JF_STATUS_NOT_FOUND, 0,
+                    "path not indexed");
+    }
+
+    if(bulkfd != -1)
+        close(bulkfd);
+
+    free(term);
+    free(path);
+}
+
+/* reply to a JF_MSG_CHANGES with every change in the journal since the
+ * generation it asks for
+ */
+static void handle_changes(ClientBuffer *c, uint32_t id, const char *payload,
+        int length) {
+    if(!c->hello) {
+        append_done(&c->out, id, JF_STATUS_BAD_VERSION, 0,
+                "no protocol version agreed");
+        return;
+    }
+
+    if(length != 8) {
+        append_done(&c->out, id, JF_STATUS_BAD_REQUEST, 0, "bad generation");
+        return;
+    }
+
+    uint64_t since = get64(payload);
+
+    append_generation(&c->out, id);
+
+    if(!journal_covers(since)) {
+        append_done(&c->out, id, JF_STATUS_RESYNC, 0, "resync required");
+        return;
+    }
+
+    /* split the changes into frames about as big as a buffer of results */
+    uint64_t gen;
+    uint32_t count = 0;
+    int frame = begin_frame(&c->out);
+    for(gen = since + 1; gen <= journal_generation; gen++) {
+        JournalEntry *e = journal_entry(gen);
+        char buf[9];
+
+        put64(buf, e->gen);
+        buf[8] = e->type;
+        append_outbuffer(&c->out, buf, 9);
+        append_outbuffer(&c->out, e->path, strlen(e->path) + 1);
+        if(e->newpath)
+            append_outbuffer(&c->out, e->newpath, strlen(e->newpath) + 1);
+        count++;
+
+        if(c->out.nbytes - c->out.start - frame >= OUTBUF_SIZE) {
+            end_frame(&c->out, frame, JF_MSG_CHANGES, JF_STATUS_OK, id);
+            frame = begin_frame(&c->out);
+        }
+    }
+    end_frame(&c->out, frame, JF_MSG_CHANGES, JF_STATUS_OK, id);
+
+    append_done(&c->out, id, JF_STATUS_OK, count, NULL);
+}
+
+/* reply to a JF_MSG_STATS with the daemon's statistics */
+static void handle_stats(TreeNode *root, ClientBuffer *c, uint32_t id) {
+    if(!c->hello) {
+        append_done(&c->out, id, JF_STATUS_BAD_VERSION, 0,
+                "no protocol version agreed");
+        return;
+    }
+
+    int frame = begin_frame(&c->out);
+    append_stats(root, &c->out);
+    end_frame(&c->out, frame, JF_MSG_STATS, JF_STATUS_OK, id);
+
+    append_done(&c->out, id, JF_STATUS_OK, 0, NULL);
+}
+
+/* stop the client's query with the given id, if it is still in progress */
+static void handle_cancel(ClientBuffer *c, uint32_t id) {
+    Request *r;
+
+    for(r = c->request; r; r = r->next) {
+        if(r->id == id) {
+            append_done(&c->out, id, JF_STATUS_CANCELLED,
+                    r->search ? search_results(r->search) : 0,
+                    "cancelled by the client");
+            end_request(r);
+            return;
+        }
+    }
+}
+
+/* handle whole messages from the binary client until it has as many queries
+ * in flight as it may have, or its output queue is full
+ * return 0 on success and -1 if the client must be disconnected
+ */
+int handle_frames(TreeNode *root, ClientBuffer *c) {
+    while(frame_startable(c)) {
+        uint32_t length = get32(c->buf);
+        int type = get16(c->buf + 4);
+        uint32_t id = get32(c->buf + 8);
+        const char *payload = c->buf + JF_HEADER_SIZE;
+
+        /* we can't skip a frame we won't buffer */
+        if(length > JF_MAX_FRAME) {
+            if(!quiet_mode)
+                fprintf(stderr, "warning: disconnecting client that sent a "
+                        "%u-byte frame\n", length);
+            return -1;
+        }
+
+        switch(type) {
+            case JF_MSG_HELLO:
+                handle_hello(c, payload, length);
+                break;
+
+            case JF_MSG_QUERY:
+                handle_query(root, c, id, payload, length);
+                break;
+
+            case JF_MSG_CHANGES:
+                handle_changes(c, id, payload, length);
+                break;
+
+            case JF_MSG_CANCEL:
+                handle_cancel(c, id);
+                break;
+
+            case JF_MSG_STATS:
+                handle_stats(root, c, id);
+                break;
+
+            default:
+                append_done(&c->out, id, JF_STATUS_BAD_REQUEST, 0,
+                        "unknown message type");
+                break;
+        }
+
+        /* move the rest of the buffer back to the start */
+        int n = JF_HEADER_SIZE + length;
+        memmove(c->buf, c->buf + n, c->nbytes - n + 1);
+        c->nbytes -= n;
+    }
+
+    return 0;
+}
+
+/* write the results collected in the bulk OutBuffer to the file, emptying it
+ * return 0 on success and -1 on failure
+ */
+static int write_bulk(int fd) {
+    while(bulk.start < bulk.nbytes) {
+        int n = write(fd, bulk.buf + bulk.start, bulk.nbytes - bulk.start);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1) {
+            bulk.start = bulk.nbytes = 0;
+            return -1;
+        }
+        bulk.start += n;
+    }
+
+    bulk.start = bulk.nbytes = 0;
+    return 0;
+}
+
+/* pass on whatever results from the request's search are ready as a
+ * JF_MSG_RESULTS frame, and finish the request with JF_MSG_DONE once the
+ * search is finished (or, for a subscription, switch to sending deltas)
+ */
+void step_binary_request(Request *r) {
+    ClientBuffer *c = r->client;
+    const char *why;
+    int done;
+
+    if((why = request_over_budget(r))) {
+        append_done(&c->out, r->id, JF_STATUS_LIMIT,
+                search_results(r->search), why);
+        end_request(r);
+        return;
+    }
+
+    if(r->bulkfd != -1) {
+        /* the results go straight to the client's file */
+        done = search_step(r->search, &bulk);
+        if(write_bulk(r->bulkfd) == -1) {
+            char msg[256];
+            snprintf(msg, sizeof(msg), "can't write results: %s",
+                    strerror(errno));
+            append_done(&c->out, r->id, JF_STATUS_IO_ERROR,
+                    search_results(r->search), msg);
+            end_request(r);
+            return;
+        }
+    } else {
+        /* the results are nul-terminated paths, straight from the search */
+        int frame = begin_frame(&c->out);
+        done = search_step(r->search, &c->out);
+        end_frame(&c->out, frame, JF_MSG_RESULTS, JF_STATUS_OK, r->id);
+    }
+
+    if(!done)
+        return;
+
+    char buf[4];
+    put32(buf, search_results(r->search));
+
+    if(r->sub) {
+        append_frame(&c->out, JF_MSG_SYNCED, JF_STATUS_OK, r->id, buf, 4);
+        release_request(r);
+        count_query(r);
+        free_search(r->search);
+        r->search = NULL;
+        sync_subscription(r->sub);
+    } else {
+        append_frame(&c->out, JF_MSG_DONE, JF_STATUS_OK, r->id, buf, 4);
+        end_request(r);
+    }
+}
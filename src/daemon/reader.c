@@ -0,0 +1,217 @@
+/* Read inotify events in a thread of their own for jfindd
+ *
+ * The kernel only queues so many inotify events, and throws the rest away
+ * when the queue overflows, which means reindexing everything. So rather than
+ * leaving events in the kernel until the main thread has finished whatever it
+ * is doing, a reader thread reads them as soon as they arrive into a ring
+ * buffer of INOTIFY_RING_SIZE bytes, which the main thread takes them from.
+ * There is one reader and one taker, so the ring needs no lock: the reader
+ * only moves the tail and the taker only moves the head.
+ *
+ * Each read() is put in the ring as a uint32 length followed by the events,
+ * so that the taker only ever takes whole events. If the ring fills up the
+ * reader waits for space, leaving events in the kernel again.
+ *
+ * James Stanley 2012
+ */
+
+#include "jfindd.h"
+
+unsigned long inotify_stalls;/* times the reader found the ring full */
+unsigned long inotify_peak;/* most bytes there have been in the ring */
+
+static char *ring;
+static unsigned long head;/* where the taker takes from next */
+static unsigned long tail;/* where the reader puts to next */
+
+static pthread_t thread;
+static int wakefd[2];/* the reader writes a byte here after putting events */
+static int stopfd[2];/* written to to stop the reader */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int waiting;/* 1 while the reader is waiting for space */
+
+#define RING_MASK (INOTIFY_RING_SIZE - 1)
+
+/* a read must always fit, even when the taker is part way through the ring */
+#if INOTIFY_RING_SIZE < 2 * (INOTIFY_BUFSIZE + 4)
+#error "INOTIFY_RING_SIZE is too small for INOTIFY_BUFSIZE"
+#endif
+
+/* copy n bytes into the ring at position pos, wrapping around the end */
+static void ring_put(unsigned long pos, const void *buf, int n) {
+    int off = pos & RING_MASK;
+    int first = n < INOTIFY_RING_SIZE - off ? n : INOTIFY_RING_SIZE - off;
+
+    memcpy(ring + off, buf, first);
+    memcpy(ring, (const char *)buf + first, n - first);
+}
+
+/* copy n bytes out of the ring from position pos, wrapping around the end */
+static void ring_get(unsigned long pos, void *buf, int n) {
+    int off = pos & RING_MASK;
+    int first = n < INOTIFY_RING_SIZE - off ? n : INOTIFY_RING_SIZE - off;
+
+    memcpy(buf, ring + off, first);
+    memcpy((char *)buf + first, ring, n - first);
+}
+
+/* wait until there are at least n bytes free in the ring */
+static void wait_for_space(int n) {
+    /* the taker looks at waiting after moving the head, and the reader
+     * looks at the head after setting waiting, so one of them sees the
+     * other
+     */
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&waiting, 1, __ATOMIC_SEQ_CST);
+    while(tail + n - __atomic_load_n(&head, __ATOMIC_SEQ_CST)
+            > INOTIFY_RING_SIZE)
+        pthread_cond_wait(&cond, &lock);
+    __atomic_store_n(&waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&lock);
+}
+
+/* put the events read into the ring, and wake the main thread */
+static void put_events(const char *buf, uint32_t n) {
+    if(tail + 4 + n - LOAD_SHARED(head) > INOTIFY_RING_SIZE) {
+        __atomic_add_fetch(&inotify_stalls, 1, __ATOMIC_RELAXED);
+        wait_for_space(4 + n);
+    }
+
+    ring_put(tail, &n, 4);
+    ring_put(tail + 4, buf, n);
+    STORE_SHARED(tail, tail + 4 + n);
+
+    unsigned long used = tail - LOAD_SHARED(head);
+    if(used > LOAD_SHARED(inotify_peak))
+        STORE_SHARED(inotify_peak, used);
+
+    char b = 0;
+    while(write(wakefd[1], &b, 1) == -1 && errno == EINTR);
+}
+
+/* read inotify events into the ring as soon as they arrive, until told to
+ * stop
+ */
+static void *reader(void *arg) {
+    char *buf = malloc(INOTIFY_BUFSIZE);
+
+    while(1) {
+        struct pollfd p[2] = { { inotify_fd, POLLIN }, { stopfd[0], POLLIN } };
+        if(poll(p, 2, -1) == -1) {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            exit(1);
+        }
+        if(p[1].revents)
+            break;
+
+        int n = read(inotify_fd, buf, INOTIFY_BUFSIZE);
+        if(n == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if(n <= 0) {
+            if(n < 0)
+                perror("inotify: read");
+            else
+                fprintf(stderr, "error: eof on inotify fd\n");
+            exit(1);
+        }
+
+        put_events(buf, n);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/* start reading events from inotify_fd in the reader thread, printing a
+ * message and dying if there is a problem
+ */
+void start_reader(void) {
+    if(!ring) {
+        ring = malloc(INOTIFY_RING_SIZE);
+        if(pipe(wakefd) == -1 || pipe(stopfd) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        /* a full pipe already means the main thread will look at the ring */
+        fcntl(wakefd[0], F_SETFL, fcntl(wakefd[0], F_GETFL) | O_NONBLOCK);
+        fcntl(wakefd[1], F_SETFL, fcntl(wakefd[1], F_GETFL) | O_NONBLOCK);
+    }
+
+    int err;
+    if((err = pthread_create(&thread, NULL, reader, NULL))) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+/* stop the reader thread and throw away any events it has read */
+void stop_reader(void) {
+    char b = 0;
+    while(write(stopfd[1], &b, 1) == -1 && errno == EINTR);
+
+    /* it may be waiting for space */
+    pthread_mutex_lock(&lock);
+    STORE_SHARED(head, tail);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, NULL);
+
+    while(read(stopfd[0], &b, 1) == -1 && errno == EINTR);
+    while(read(wakefd[0], &b, 1) > 0);
+    head = tail = 0;
+}
+
+/* return the fd that becomes readable when the reader has put events in the
+ * ring
+ */
+int reader_fd(void) {
+    return wakefd[0];
+}
+
+/* return the number of bytes waiting in the ring */
+unsigned long reader_backlog(void) {
+    return LOAD_SHARED(tail) - head;
+}
+
+/* take as many whole reads' worth of events from the ring as fit in the
+ * buffer of "size" bytes, which must be at least INOTIFY_BUFSIZE
+ * return the number of bytes taken
+ */
+int take_events(char *buf, int size) {
+    unsigned long end = LOAD_SHARED(tail);
+    int n = 0;
+
+    if(head == end)
+        return 0;
+
+    /* empty the pipe before looking for events, so that events put after
+     * this always leave a byte in it
+     */
+    char b[256];
+    while(read(wakefd[0], b, sizeof(b)) > 0);
+    end = LOAD_SHARED(tail);
+
+    while(head != end) {
+        uint32_t len;
+        ring_get(head, &len, 4);
+        if(n + len > size)
+            break;
+
+        ring_get(head + 4, buf + n, len);
+        n += len;
+        __atomic_store_n(&head, head + 4 + len, __ATOMIC_SEQ_CST);
+    }
+
+    if(__atomic_load_n(&waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return n;
+}
@@ -0,0 +1,328 @@
+/* Run searches for jfindd
+ *
+ * A search is split into parts, each of which is a traversal of some of the
+ * tree with its own OutBuffer. With more than one worker thread, large searches
+ * are split into several parts so that the workers can run them at the same
+ * time; the results are then passed on to the client either in tree order or
+ * in whatever order the parts produce them.
+ */
+
+#include "jfindd.h"
+
+/* append nbytes of buf to the OutBuffer, growing it as necessary */
+void append_outbuffer(OutBuffer *o, const char *buf, int nbytes) {
+    /* move unsent data back to the start of the buffer to make space */
+    if(o->nbytes + nbytes > o->nallocd && o->start) {
+        memmove(o->buf, o->buf + o->start, o->nbytes - o->start);
+        o->nbytes -= o->start;
+        o->start = 0;
+    }
+
+    /* grow the buffer if there still isn't space */
+    if(o->nbytes + nbytes > o->nallocd) {
+        o->nallocd = o->nbytes + nbytes + OUTBUF_SIZE;
+        o->buf = realloc(o->buf, o->nallocd);
+    }
+
+    memcpy(o->buf + o->nbytes, buf, nbytes);
+    o->nbytes += nbytes;
+}
+
+/* return 1 if the OutBuffer is full enough that the search should wait for
+ * some of it to be sent, and 0 otherwise
+ */
+int outbuffer_full(OutBuffer *o) {
+    return o->nbytes - o->start >= OUTBUF_SIZE;
+}
+
+/* move everything from the src OutBuffer to the end of dst */
+static void move_outbuffer(OutBuffer *dst, OutBuffer *src) {
+    append_outbuffer(dst, src->buf + src->start, src->nbytes - src->start);
+    src->start = src->nbytes = 0;
+}
+
+/* add a part that runs the given traversal to the search */
+static void add_part(Search *s, Traversal *tr) {
+    if(s->nparts == s->nallocd) {
+        s->nallocd = s->nallocd ? s->nallocd * 2 : 16;
+        s->part = realloc(s->part, s->nallocd * sizeof(SearchPart));
+    }
+
+    SearchPart *p = s->part + s->nparts++;
+    memset(p, 0, sizeof(SearchPart));
+    p->tr = tr;
+    p->search = s;
+}
+
+/* return the number of nodes in the subtree rooted at t */
+static int subtree_size(TreeNode *t) {
+    return 1 + (t->dir ? t->dir->nnodes : 0);
+}
+
+/* split the subtree rooted at t (whose parent has the path parentpath) into
+ * parts of roughly "target" nodes each, in tree order: t on its own, and then
+ * runs of children whose subtrees add up to no more than target, except that
+ * children with bigger subtrees are split further
+ */
+static void split_search(Search *s, TreeNode *t, const char *parentpath,
+        int target) {
+    add_part(s, new_node_traversal(t, parentpath, 0));
+
+    ChildArray *a = t->dir->children;
+    if(!a)
+        return;
+
+    char *path = strallocat(parentpath, t->name, "/", NULL);
+
+    int lo = 0;
+    int size = 0;
+    int i;
+    for(i = 0; i < a->nchilds; i++) {
+        TreeNode *child = a->child[i];
+        if(!child)
+            continue;
+
+        int n = subtree_size(child);
+
+        /* big subtrees are split up on their own */
+        if(n > target && child->dir && strlen(path) < PATH_MAX - 2) {
+            if(i > lo)
+                add_part(s, new_range_traversal(a, lo, i, path));
+            split_search(s, child, path, target);
+            lo = i + 1;
+            size = 0;
+            continue;
+        }
+
+        /* start a new run if this one is big enough */
+        if(size + n > target && i > lo) {
+            add_part(s, new_range_traversal(a, lo, i, path));
+            lo = i;
+            size = 0;
+        }
+        size += n;
+    }
+    if(i > lo)
+        add_part(s, new_range_traversal(a, lo, i, path));
+
+    free(path);
+}
+
+/* start a search for paths containing the given term under the given path,
+ * writing "sep" after each result; if unordered is non-zero, results from
+ * different parts of the tree may be interleaved
+ * returns NULL if "path" is not in the tree or is too long
+ */
+Search *new_search(TreeNode *root, const char *path, const char *term,
+        int unordered, char sep) {
+    Traversal *tr;
+
+    if(!(tr = new_traversal(root, path)))
+        return NULL;
+
+    Search *s = malloc(sizeof(Search));
+    memset(s, 0, sizeof(Search));
+    s->term = strdup(term);
+    s->unordered = unordered;
+    s->sep = sep;
+
+    /* split big searches up between the workers; tr->next is the node the
+     * search starts at and the path so far is its parent's
+     */
+    TreeNode *t = tr->next;
+    s->size = subtree_size(t);
+
+    int target = 0;
+    if(nworkers > 1)
+        target = s->size / (nworkers * SEARCH_PARTS_PER_WORKER);
+    if(t->dir && target >= SEARCH_SLICE) {
+        tr->path[tr->nextlen] = '\0';
+        split_search(s, t, tr->path, target);
+        free_traversal(tr);
+    } else {
+        add_part(s, tr);
+    }
+
+    return s;
+}
+
+/* free the given search, which must not have any parts running in workers */
+void free_search(Search *s) {
+    if(!s)
+        return;
+
+    assert(!s->nbusy);/* workers mustn't be using it */
+
+    int i;
+    for(i = 0; i < s->nparts; i++) {
+        free_traversal(s->part[i].tr);
+        free(s->part[i].out.buf);
+    }
+    free(s->part);
+    free(s->term);
+    free_cacheentry(s->fill);
+    free(s);
+}
+
+/* run the part's traversal until it finishes, its OutBuffer is full,
+ * "budget" nodes have been visited, or the search is cancelled; this is run
+ * in a worker thread if there are any, so it must only touch the part itself
+ * (and read the search's cancelled flag)
+ */
+/* TODO: regex search */
+void run_search_part(SearchPart *p, int budget) {
+    long visited = p->nvisited;
+    char *path;
+
+    PROBE1(search_slice_start, p->search);
+
+    while(!outbuffer_full(&p->out) && budget-- > 0
+            && !LOAD_SHARED(p->search->cancelled)) {
+        if(!traversal_next(p->tr, &path)) {
+            p->done = 1;
+            break;
+        }
+        p->nvisited++;
+
+        if(strstr(path, p->search->term)) {
+            PROBE2(query_match, p->search, path);
+            append_outbuffer(&p->out, path, strlen(path));
+            append_outbuffer(&p->out, &p->search->sep, 1);
+            p->nresults++;
+        }
+    }
+
+    PROBE2(search_slice_end, p->search, p->nvisited - visited);
+}
+
+/* return 1 if the part can be run (it is not finished, is not already
+ * running, and has space for more results) and 0 otherwise
+ */
+static int part_runnable(SearchPart *p) {
+    return !p->busy && !p->done && !outbuffer_full(&p->out);
+}
+
+/* return 1 if results from the part can be passed on to the client now */
+static int part_drainable(Search *s, SearchPart *p) {
+    if(p->busy || p->out.start == p->out.nbytes)
+        return 0;
+
+    return s->unordered || p == s->part + s->head;
+}
+
+/* move whatever results can be passed on from the parts to the client's
+ * OutBuffer, until it is full
+ */
+static void drain_search(Search *s, OutBuffer *out) {
+    int i;
+
+    if(s->unordered) {
+        for(i = s->head; i < s->nparts && !outbuffer_full(out); i++)
+            if(part_drainable(s, s->part + i))
+                move_outbuffer(out, &s->part[i].out);
+    } else {
+        while(s->head < s->nparts && !outbuffer_full(out)) {
+            SearchPart *p = s->part + s->head;
+            if(part_drainable(s, p))
+                move_outbuffer(out, &p->out);
+            if(p->busy || !p->done || p->out.start != p->out.nbytes)
+                break;
+            s->head++;
+        }
+    }
+
+    /* skip past any finished parts at the start */
+    while(s->head < s->nparts && !s->part[s->head].busy
+            && s->part[s->head].done
+            && s->part[s->head].out.start == s->part[s->head].out.nbytes)
+        s->head++;
+}
+
+/* return 1 if the search is finished and all of its results have been passed
+ * on, and 0 otherwise
+ */
+int search_finished(Search *s) {
+    return s->head == s->nparts;
+}
+
+/* return 1 if search_step() can make progress with the search without
+ * waiting for the workers (or for the client to read some results)
+ */
+int search_runnable(Search *s, OutBuffer *out) {
+    if(search_finished(s))
+        return 1;
+    if(outbuffer_full(out))
+        return 0;
+
+    /* parts beyond one per worker wait for the others */
+    int canrun = !nworkers || s->nbusy < nworkers;
+
+    int i;
+    for(i = s->head; i < s->nparts; i++)
+        if((canrun && part_runnable(s->part + i))
+                || part_drainable(s, s->part + i))
+            return 1;
+
+    return 0;
+}
+
+/* pass on whatever results are ready to the given OutBuffer, and then get
+ * the parts that can run going: in the workers if there are any, otherwise by
+ * running a slice of SEARCH_SLICE nodes here
+ * return 1 if the search is finished and 0 otherwise
+ */
+int search_step(Search *s, OutBuffer *out) {
+    int before = out->nbytes - out->start;
+
+    drain_search(s, out);
+
+    int i;
+    for(i = s->head; i < s->nparts; i++) {
+        SearchPart *p = s->part + i;
+        if(!part_runnable(p))
+            continue;
+
+        if(nworkers) {
+            /* leave the rest of the workers' queue for other searches */
+            if(s->nbusy >= nworkers)
+                break;
+            p->busy = 1;
+            s->nbusy++;
+            submit_work(p);
+        } else {
+            run_search_part(p, SEARCH_SLICE);
+            drain_search(s, out);
+            break;
+        }
+    }
+
+    /* keep a copy of the results for the cache, unless there are too many */
+    if(s->fill) {
+        int n = out->nbytes - out->start - before;
+        append_outbuffer(&s->fill->results, out->buf + out->nbytes - n, n);
+        if(s->fill->results.nbytes > s->fill->limit) {
+            free_cacheentry(s->fill);
+            s->fill = NULL;
+        }
+    }
+
+    if(!search_finished(s))
+        return 0;
+
+    if(s->fill)
+        cache_store(s);
+
+    return 1;
+}
+
+/* return the number of results the search has found so far */
+int search_results(Search *s) {
+    int n = 0;
+    int i;
+
+    for(i = 0; i < s->nparts; i++)
+        if(!s->part[i].busy)
+            n += s->part[i].nresults;
+
+    return n;
+}
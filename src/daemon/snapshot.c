@@ -0,0 +1,189 @@
+/* Publish snapshots of the index for jfindd (see snapshot.h)
+ *
+ * A snapshot is written by a search for "" under "/", which gives every path
+ * in tree order and runs in slices on the workers like any other search, so
+ * the main loop keeps handling inotify events and clients while it goes.
+ *
+ * James Stanley 2012
+ */
+
+#include "jfindd.h"
+
+int snapshot_mode;
+
+static Search *search;/* the search writing the next snapshot, if any */
+static OutBuffer out;
+static int fd = -1;/* the temporary file it is being written to */
+static char tmppath[] = SNAPSHOT_PATH ".XXXXXX";/* and its name, once made */
+static int made;/* 1 while there is a temporary file to remove */
+static int failed;/* 1 if the search is only waiting to be freed */
+static SnapshotHeader header;
+static uint64_t published;/* generation of the last snapshot published */
+static time_t last;/* when the last snapshot was started */
+
+/* stop writing the snapshot in progress and remove the temporary file; the
+ * search is freed once the workers are finished with it
+ */
+static void abandon_snapshot(void) {
+    if(fd != -1)
+        close(fd);
+    fd = -1;
+    if(made)
+        unlink(tmppath);
+    made = 0;
+    out.start = out.nbytes = 0;
+
+    failed = 1;
+    if(search && search->nbusy)
+        return;
+
+    free_search(search);
+    search = NULL;
+    failed = 0;
+}
+
+/* give up on the snapshot being written, printing a warning */
+static void snapshot_error(const char *what) {
+    fprintf(stderr, "warning: %s: %s: %s\n", what,
+            made ? tmppath : SNAPSHOT_PATH, strerror(errno));
+    abandon_snapshot();
+}
+
+/* start writing a snapshot of the tree */
+static void begin_snapshot(TreeNode *root) {
+    last = time(NULL);
+
+    /* the directory is writable by anyone, so the file must have a name
+     * nobody can guess and have put something at first (jfindd may well be
+     * running as root); it is made readable by everyone once it exists
+     */
+    strcpy(tmppath + strlen(tmppath) - 6, "XXXXXX");
+    if((fd = mkostemp(tmppath, O_CLOEXEC)) == -1) {
+        snapshot_error("mkostemp");
+        return;
+    }
+    made = 1;
+
+    if(fchmod(fd, 0644) == -1) {
+        snapshot_error("fchmod");
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JF_SNAPSHOT_MAGIC, 8);
+    header.version = JF_SNAPSHOT_VERSION;
+    header.generation = journal_generation;
+
+    /* leave space for the header, which is written once the size is known */
+    if(lseek(fd, sizeof(header), SEEK_SET) == -1) {
+        snapshot_error("lseek");
+        return;
+    }
+
+    search = new_search(root, "/", "", 0, '\0');
+}
+
+/* write out whatever paths the search has passed on
+ * return 0 on success and -1 on failure
+ */
+static int write_paths(void) {
+    while(out.start < out.nbytes) {
+        int n = write(fd, out.buf + out.start, out.nbytes - out.start);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1)
+            return -1;
+        out.start += n;
+        header.size += n;
+    }
+
+    out.start = out.nbytes = 0;
+    return 0;
+}
+
+/* fill in the header and put the finished snapshot in place of the last one */
+static void publish_snapshot(void) {
+    header.npaths = search_results(search);
+
+    if(pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        snapshot_error("write");
+        return;
+    }
+    if(rename(tmppath, SNAPSHOT_PATH) == -1) {
+        snapshot_error("rename");
+        return;
+    }
+    made = 0;
+
+    published = header.generation;
+
+    free_search(search);
+    search = NULL;
+    close(fd);
+    fd = -1;
+}
+
+/* start a snapshot if the tree has changed since the last one and it's time
+ * for another, and get on with the one being written
+ */
+void step_snapshot(TreeNode *root) {
+    if(!snapshot_mode)
+        return;
+
+    if(failed) {
+        abandon_snapshot();
+        return;
+    }
+
+    if(!search) {
+        if(published && published == journal_generation)
+            return;
+        if(time(NULL) - last < SNAPSHOT_INTERVAL)
+            return;
+
+        begin_snapshot(root);
+        if(!search)
+            return;
+    }
+
+    if(!search_runnable(search, &out))
+        return;
+
+    int done = search_step(search, &out);
+
+    if(write_paths() == -1)
+        snapshot_error("write");
+    else if(done)
+        publish_snapshot();
+}
+
+/* return the number of milliseconds the main loop can wait for events before
+ * step_snapshot() has something to do, or -1 if it can wait forever
+ */
+int snapshot_timeout(void) {
+    if(!snapshot_mode)
+        return -1;
+
+    /* a snapshot in progress is woken up by the workers if it's waiting for
+     * them
+     */
+    if(failed)
+        return -1;
+    if(search)
+        return search_runnable(search, &out) ? 0 : -1;
+
+    if(published && published == journal_generation)
+        return -1;
+
+    time_t wait = last + SNAPSHOT_INTERVAL - time(NULL);
+    return wait > 0 ? wait * 1000 : 0;
+}
+
+/* stop writing the snapshot in progress, if any, because the tree is going
+ * away (the workers must be finished with it); the last one published stays
+ * where it is
+ */
+void stop_snapshot(void) {
+    if(search)
+        abandon_snapshot();
+}
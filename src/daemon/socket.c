@@ -6,6 +6,195 @@
 #include "jfindd.h"
 
 static ClientBuffer *fd_hash;
+static ClientBuffer *runqueue;/* clients with work to do, in turn */
+static ClientBuffer *runqueue_tail;
+
+static int epfd;
+static int sparefd = -1;/* kept free so that we can refuse clients politely */
+
+static int client_has_work(ClientBuffer *c);
+static int client_finished(ClientBuffer *c);
+static int handle_client_work(TreeNode *root, ClientBuffer *c);
+static int handle_client_event(TreeNode *root, int fd, uint32_t events);
+
+/* add the fd to the epoll set, printing a message and dying on error */
+static void watch_fd(int fd, uint32_t events) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/* close the inotify fd, the listening socket and all of the clients */
+static void close_all(int sockfd) {
+    ClientBuffer *c, *tmp;
+
+    HASH_ITER(hh, fd_hash, c, tmp) {
+        close(c->fd);
+        clear_clientbuffer(c->fd);
+    }
+
+    stop_inotify();
+    close(sockfd);
+    close(epfd);
+
+    /* wait for the workers to finish with the tree and the clients */
+    while(workers_busy()) {
+        struct pollfd p = { worker_fd(), POLLIN };
+        poll(&p, 1, -1);
+        handle_worker_events();
+    }
+}
+
+/* tell the client why it can't be served, and disconnect it */
+static void refuse_client(int fd, const char *why) {
+    char msg[256];
+
+    snprintf(msg, sizeof(msg), "error: %s\n\n", why);
+
+    /* the client is new, so there is space in the socket buffer for this */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if(write(fd, msg, strlen(msg)) == -1 && !quiet_mode)
+        perror("write");
+    close(fd);
+}
+
+/* start serving the newly-accepted client on fd */
+static void add_client(int fd) {
+    struct epoll_event ev;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    /* clients are shared out by the user connecting */
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        perror("getsockopt");
+        cred.uid = (uid_t)-1;
+    }
+
+    User *u = add_user_client(cred.uid);
+    if(u->nclients > MAX_USER_CLIENTS) {
+        remove_user_client(u);
+        refuse_client(fd, "too many clients for this user");
+        return;
+    }
+
+    /* searches are written out as the client reads them, so the client must
+     * never block us
+     */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    /* clients are edge-triggered; they are read and written until EAGAIN */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.fd = fd;
+
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        remove_user_client(u);
+        refuse_client(fd, "out of resources");
+        return;
+    }
+
+    ClientBuffer *c = new_clientbuffer(fd);
+    c->user = u;
+    HASH_ADD_INT(fd_hash, fd, c);
+}
+
+/* accept all of the clients waiting to connect */
+static void accept_clients(int sockfd) {
+    int fd;
+
+    while(1) {
+        if((fd = accept(sockfd, NULL, NULL)) != -1) {
+            add_client(fd);
+            continue;
+        }
+
+        if(errno == EINTR || errno == ECONNABORTED)
+            continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+
+        if(errno != EMFILE && errno != ENFILE) {
+            perror("accept");
+            return;
+        }
+
+        /* out of fds; give up the spare one so that the client can be
+         * accepted and told what is going on, rather than being left waiting
+         */
+        fprintf(stderr, "warning: had to disconnect a client because we "
+                "have run out of file descriptors\n");
+        close(sparefd);
+        fd = accept(sockfd, NULL, NULL);
+        if(fd != -1)
+            refuse_client(fd, "too many clients");
+        sparefd = open("/dev/null", O_RDONLY);
+
+        if(fd == -1)
+            return;
+    }
+}
+
+/* add the client to the back of the run queue if it has work to do and isn't
+ * already there
+ */
+void schedule_client(ClientBuffer *c) {
+    if(c->runnable || c->closed)
+        return;
+
+    if(!client_has_work(c))
+        return;
+
+    c->runnable = 1;
+    c->prev = runqueue_tail;
+    c->next = NULL;
+    if(runqueue_tail)
+        runqueue_tail->next = c;
+    else
+        runqueue = c;
+    runqueue_tail = c;
+}
+
+/* remove the client from the run queue, if it is on it */
+static void unschedule_client(ClientBuffer *c) {
+    if(!c->runnable)
+        return;
+
+    if(c->prev)
+        c->prev->next = c->next;
+    else
+        runqueue = c->next;
+    if(c->next)
+        c->next->prev = c->prev;
+    else
+        runqueue_tail = c->prev;
+
+    c->runnable = 0;
+}
+
+/* return the sooner of two epoll_wait() timeouts, where -1 means forever */
+static int sooner(int a, int b) {
+    if(a == -1)
+        return b;
+    if(b == -1)
+        return a;
+    return a < b ? a : b;
+}
+
+/* disconnect the client */
+static void close_client(ClientBuffer *c) {
+    int fd = c->fd;
+
+    close(fd);
+    clear_clientbuffer(fd);
+}
 
 /* bind to a unix socket and run the main loop processing inotify events and
  * giving search results to clients
@@ -16,6 +205,7 @@ static ClientBuffer *fd_hash;
  */
 void run(TreeNode *root, const char *sockpath) {
     int sockfd;
+    unsigned long pass = 0;/* number of passes of the run queue */
 
     /* make a socket */
     if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
@@ -37,116 +227,136 @@ void run(TreeNode *root, const char *sockpath) {
         exit(1);
     }
 
-    /* listen on this fd */
-    if(listen(sockfd, 5) == -1) {
+    /* listen on this fd; clients are accepted until there are none left */
+    if(listen(sockfd, SOMAXCONN) == -1) {
         perror("listen");
         exit(1);
     }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
 
-#define MAXPOLLFDS 256
-    struct pollfd fds[MAXPOLLFDS];
-    int nfds;
+    if(sparefd == -1)
+        sparefd = open("/dev/null", O_RDONLY);
 
-    fds[0].fd = inotify_fd;
-    fds[0].events = POLLIN;
-    fds[1].fd = sockfd;
-    fds[1].events = POLLIN;
-    nfds = 2;
+    if((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    /* inotify events, clients and finished slices are each handled a batch
+     * at a time, so these are level-triggered
+     */
+    watch_fd(reader_fd(), EPOLLIN);
+    watch_fd(sockfd, EPOLLIN);
+    watch_fd(worker_fd(), EPOLLIN);
 
     /* don't die when a client disconnects prematurely */
     signal(SIGPIPE, SIG_IGN);
 
     while(1) {
-        /* wait for input on any of the fds */
-        if(poll(fds, nfds, -1) == -1) {
-            perror("poll");
+#define MAXEVENTS 64
+        struct epoll_event ev[MAXEVENTS];
+        int n;
+
+        /* wait for events, unless a client has a search to get on with or
+         * it's time to get on with a snapshot or check polled directories
+         */
+        int timeout = runqueue ? 0
+            : sooner(sooner(snapshot_timeout(), poller_timeout()),
+                    move_timeout());
+        if((n = epoll_wait(epfd, ev, MAXEVENTS, timeout)) == -1) {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
             exit(1);
         }
 
         /* handle events */
         int i;
-        int ndeleted = 0;
-        for(i = 0; i < nfds; i++) {
-            /* die if there is a problem */
-            /* TODO: handle this; when can it happen? */
-            if(fds[i].revents & POLLERR) {
-                fprintf(stderr, "error: read error on pollfd %d (.fd=%d)\n",
-                        i, fds[i].fd);
-                exit(1);
-            }
+        for(i = 0; i < n; i++) {
+            int fd = ev[i].data.fd;
 
-            if(fds[i].revents & POLLHUP) {
-                /* stream closed
-                 * die if the inotify or listening socket fd are closed
+            if(fd == reader_fd() || fd == sockfd || fd == worker_fd()) {
+                /* die if there is a problem with the inotify, listening
+                 * socket or worker fds
                  */
-                if(i < 2) {
-                    fprintf(stderr, "error: pollfd %d (%s) closed (.fd=%d)\n",
-                            i, (i == 0 ? "inotify" : "socket"), fds[i].fd);
+                /* TODO: handle this; when can it happen? */
+                if(ev[i].events & (EPOLLERR | EPOLLHUP)) {
+                    fprintf(stderr, "error: %s fd closed (.fd=%d)\n",
+                            (fd == reader_fd() ? "inotify" : fd == sockfd
+                                ? "socket" : "workers"), fd);
                     exit(1);
                 }
 
-                /* close the client fd and mark it as unused */
-                close(fds[i].fd);
-                clear_clientbuffer(fds[i].fd);
-                fds[i].fd = -1;
-            } else if(fds[i].revents & POLLIN) {
-                /* data available
-                 * handle the fd in an appropriate manner
-                 */
-                if(i == 0) {
+                if(fd == reader_fd()) {
                     /* inotify events */
                     if(handle_inotify_events(root) == -1) {
                         /* something terrible happened; close all fds and
                          * return so that the fs gets reindexed and we start
                          * afresh
                          */
-                        for(i = 0; i < nfds; i++)
-                            close(fds[i].fd);
+                        close_all(sockfd);
                         return;
                     }
-                } else if(i == 1) {
-                    /* connection from client */
-                    struct sockaddr_un remote;
-                    socklen_t len = sizeof(struct sockaddr_un);
-
-                    int fd = accept(sockfd, (struct sockaddr *)&remote, &len);
-
-                    if(nfds == MAXPOLLFDS) {
-                        fprintf(stderr, "warning: had to disconnect a client "
-                                "because we already have %d open fds (try "
-                                "increasing MAXPOLLFDS in " __FILE__ ")\n",
-                                MAXPOLLFDS);
-                        /* TODO: write some error message to the socket */
-                        close(fd);
-                    } else {
-                        fds[nfds].fd = fd;
-                        fds[nfds].events = POLLIN;
-                        fds[nfds].revents = 0;
-                        nfds++;
-                    }
+                } else if(fd == sockfd) {
+                    /* connections from clients */
+                    accept_clients(sockfd);
                 } else {
-                    /* data from client */
-                    if(handle_client_data(root, fds[i].fd) == -1) {
-                        close(fds[i].fd);
-                        clear_clientbuffer(fds[i].fd);
-                        fds[i].fd = -1;
-                    }
+                    /* workers have finished some slices */
+                    handle_worker_events();
                 }
+            } else {
+                /* data from a client, space to write results to it, or a
+                 * hangup
+                 */
+                handle_client_event(root, fd, ev[i].events);
             }
+        }
 
-            /* shuffle this pollfd along to overwrite deleted ones
-             * (note: no-op when ndeleted=0)
-             */
-            fds[i - ndeleted] = fds[i];
+        /* run a slice of the search of each client that has work to do,
+         * dealing with inotify events first so that they never wait for a
+         * whole search; clients that still have work go to the back of the
+         * queue
+         * if more than one user is waiting, each of them gets one turn per
+         * pass however many clients they have, and the rest wait for the
+         * next pass
+         */
+        ClientBuffer *c;
+        ClientBuffer *last = runqueue_tail;
+        int shared = 0;
+        for(c = runqueue; c && c != last; c = c->next)
+            if(c->next->user != runqueue->user)
+                shared = 1;
+        pass++;
+
+        while((c = runqueue)) {
+            int islast = (c == last);
+
+            unschedule_client(c);
+
+            if(shared && c->user->turn == pass) {
+                schedule_client(c);
+                if(islast)
+                    break;
+                continue;
+            }
+            c->user->turn = pass;
 
-            /* if this pollfd was deleted, shuffle future ones along by one
-             * extra place
-             */
-            if(fds[i].fd == -1)
-                ndeleted++;
+            if(handle_inotify_events(root) == -1) {
+                close_all(sockfd);
+                return;
+            }
+            if(handle_client_work(root, c) == -1)
+                close_client(c);
+            else
+                schedule_client(c);
+
+            if(islast)
+                break;
         }
 
-        nfds -= ndeleted;
+        step_snapshot(root);
+        step_poller(root);
+        expire_moves();
     }
 
     fprintf(stderr, "error: execution left infinite loop!\n");
@@ -161,12 +371,105 @@ ClientBuffer *new_clientbuffer(int fd) {
 
     c->fd = fd;
     c->buf = malloc(1024);
+    c->buf[0] = '\0';
     c->nallocd = 1024;
 
     return c;
 }
 
-/* free the buffer associated with this fd */
+/* start answering a query with the given id from the client, using the
+ * search s
+ */
+Request *new_request(ClientBuffer *c, uint32_t id, Search *s) {
+    Request *r = malloc(sizeof(Request));
+
+    memset(r, 0, sizeof(Request));
+
+    r->id = id;
+    r->search = s;
+    r->client = c;
+    r->bulkfd = -1;
+    s->request = r;
+    clock_gettime(CLOCK_MONOTONIC, &r->started);
+    PROBE3(query_start, s, s->term, s->size);
+
+    /* add it to the end of the client's requests */
+    Request **p;
+    for(p = &c->request; *p; p = &(*p)->next);
+    *p = r;
+    c->nrequests++;
+    c->user->nrequests++;
+
+    admit_request(r);
+
+    return r;
+}
+
+/* stop answering the request and free it */
+void end_request(Request *r) {
+    ClientBuffer *c = r->client;
+
+    Request **p;
+    for(p = &c->request; *p != r; p = &(*p)->next);
+    *p = r->next;
+    c->nrequests--;
+
+    if(r->search) {
+        release_request(r);
+        count_query(r);
+    }
+
+    /* the user's other clients can start queries again */
+    if(c->user->nrequests-- == MAX_USER_REQUESTS) {
+        ClientBuffer *other, *tmp;
+        HASH_ITER(hh, fd_hash, other, tmp)
+            if(other->user == c->user)
+                schedule_client(other);
+    }
+
+    if(r->sub)
+        unsubscribe(r->sub);
+    if(r->bulkfd != -1)
+        close(r->bulkfd);
+    if(c->refine == r)
+        c->refine = NULL;
+
+    /* a search that workers are still running parts of is freed when they
+     * are finished with it, which they will be as soon as they notice
+     */
+    if(r->search && r->search->nbusy) {
+        r->search->request = NULL;
+        STORE_SHARED(r->search->cancelled, 1);
+    } else {
+        free_search(r->search);
+    }
+    free(r);
+
+    /* a client that has shut down its end may be finished with now */
+    if(c->eof)
+        schedule_client(c);
+}
+
+/* free the given ClientBuffer */
+static void free_clientbuffer(ClientBuffer *c) {
+    /* so that ending its requests doesn't put it back on the run queue */
+    c->closed = 1;
+
+    while(c->request)
+        end_request(c->request);
+    while(c->nfds)
+        close(take_client_fd(c));
+    free(c->refineterm);
+    free(c->refinepath);
+    remove_user_client(c->user);
+    free(c->out.buf);
+    free(c->buf);
+    free(c);
+}
+
+/* free the buffer associated with this fd, cancelling its queries; searches
+ * that workers are running parts of are freed once they stop
+ */
 void clear_clientbuffer(int fd) {
     ClientBuffer *c;
 
@@ -176,92 +479,401 @@ void clear_clientbuffer(int fd) {
     if(!c)
         return;
 
-    /* remove from the hash and free up memory */
+    /* remove from the hash and the run queue, and free up memory */
     HASH_DEL(fd_hash, c);
-    free(c->buf);
-    free(c);
+    unschedule_client(c);
+    free_clientbuffer(c);
 }
 
-static int search_fd;
-static char *search_term;
+/* write as much of the OutBuffer to the client as it will currently accept
+ * without blocking
+ * return 0 on success and -1 on error
+ */
+static int flush_outbuffer(ClientBuffer *c) {
+    OutBuffer *o = &c->out;
+
+    while(o->start < o->nbytes) {
+        int n = write(c->fd, o->buf + o->start, o->nbytes - o->start);
+
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        o->start += n;
+    }
+
+    /* the queue is empty, so it can start again from the beginning */
+    if(o->start == o->nbytes)
+        o->start = o->nbytes = 0;
+
+    /* searches wait while the queue is full, and that time doesn't count
+     * against their time limit
+     */
+    int full = outbuffer_full(o);
+    if(full && !c->full)
+        clock_gettime(CLOCK_MONOTONIC, &c->full_since);
+    else if(!full && c->full)
+        c->blocked += seconds_since(&c->full_since);
+    c->full = full;
+
+    return 0;
+}
+
+/* send as much of the client's queued output as it will currently accept;
+ * errors are noticed by epoll as a hangup
+ */
+void send_client_output(ClientBuffer *c) {
+    flush_outbuffer(c);
+}
+
+/* start searches for any query lines from a line-protocol client until one is
+ * running (searches for paths that aren't in the tree finish straight away)
+ */
+static void start_line_queries(TreeNode *root, ClientBuffer *c) {
+    char *end;
+
+    while(!c->request && user_may_query(c->user) && !outbuffer_full(&c->out)
+            && (end = strchr(c->buf, '\n'))) {
+        *end = '\0';
+
+        CacheEntry *e = cache_lookup(root, "/", c->buf, unordered_mode, '\n');
+        Search *s = NULL;
+        if(e) {
+            append_outbuffer(&c->out, e->results.buf, e->results.nbytes);
+            append_outbuffer(&c->out, "\n", 1);
+        } else if((s = new_search(root, "/", c->buf, unordered_mode, '\n'))) {
+            cache_fill(s, "/", CACHE_ENTRY_SIZE);
+            new_request(c, 0, s);
+        } else {
+            append_outbuffer(&c->out, "\n", 1);
+        }
+
+        /* move the rest of the buffer back to the start */
+        memmove(c->buf, end+1, c->nbytes + c->buf - end);
+        c->nbytes -= end - c->buf + 1;
+    }
+}
+
+/* pass on whatever results from a line-protocol request's search are ready,
+ * and end the request once they have all been passed on
+ */
+static void step_line_request(Request *r) {
+    ClientBuffer *c = r->client;
+    const char *why;
+
+    /* there's no way to say why the results stop short, other than in our
+     * own log
+     */
+    if((why = request_over_budget(r))) {
+        if(!quiet_mode)
+            fprintf(stderr, "warning: ending search for \"%s\": %s\n",
+                    r->search->term, why);
+        append_outbuffer(&c->out, "\n", 1);
+        end_request(r);
+        return;
+    }
+
+    if(search_step(r->search, &c->out)) {
+        /* write a final endline to the client */
+        append_outbuffer(&c->out, "\n", 1);
+        end_request(r);
+    }
+}
+
+/* get on with the request in whichever protocol the client speaks; this may
+ * end the request
+ */
+static void step_request(Request *r) {
+    if(r->client->proto == PROTO_BINARY)
+        step_binary_request(r);
+    else
+        step_line_request(r);
+}
+
+/* return 1 if more should be read from the client now, and 0 if it already
+ * has as many queries in progress or buffered as it may have; a binary client
+ * is read until it has a whole message buffered even then, in case it is a
+ * cancellation
+ */
+static int client_wants_input(ClientBuffer *c) {
+    switch(c->proto) {
+        case PROTO_LINE:
+            return !c->request && !strchr(c->buf, '\n');
+        case PROTO_BINARY:
+            return !frame_ready(c);
+        default:
+            return 1;
+    }
+}
+
+/* return 1 if the client has shut down its end and everything it asked for
+ * has been sent, so that it can be closed, and 0 otherwise
+ */
+static int client_finished(ClientBuffer *c) {
+    if(!c->eof || c->request || c->out.start < c->out.nbytes)
+        return 0;
+
+    /* queries it sent before it shut down are still answered */
+    switch(c->proto) {
+        case PROTO_LINE:
+            return !strchr(c->buf, '\n');
+        case PROTO_BINARY:
+            return !frame_ready(c);
+        default:
+            return 1;
+    }
+}
+
+/* keep the files passed by the client in the message, for the queries that
+ * go with them, unless it has passed more than it can have queries
+ */
+static void keep_client_fds(ClientBuffer *c, struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+
+    for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int *fd = (int *)CMSG_DATA(cmsg);
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int i;
+        for(i = 0; i < n; i++) {
+            if(c->nfds < MAX_REQUESTS)
+                c->fds[c->nfds++] = fd[i];
+            else
+                close(fd[i]);
+        }
+    }
+}
+
+/* return the oldest file passed by the client that hasn't been used yet, or
+ * -1 if there isn't one
+ */
+int take_client_fd(ClientBuffer *c) {
+    if(!c->nfds)
+        return -1;
+
+    int fd = c->fds[0];
+    memmove(c->fds, c->fds + 1, --c->nfds * sizeof(int));
+
+    return fd;
+}
+
+/* return the number of clients connected */
+int client_count(void) {
+    return HASH_COUNT(fd_hash);
+}
+
+/* return the number of bytes of buffers the clients have */
+unsigned long client_bytes(void) {
+    ClientBuffer *c, *tmp;
+    unsigned long n = 0;
+
+    HASH_ITER(hh, fd_hash, c, tmp)
+        n += sizeof(ClientBuffer) + c->nallocd + c->out.nallocd;
+
+    return n;
+}
+
+/* return the number of seconds the client's searches have spent waiting for
+ * it to read its output
+ */
+double client_blocked_seconds(ClientBuffer *c) {
+    if(c->full)
+        return c->blocked + seconds_since(&c->full_since);
+    return c->blocked;
+}
+
+/* read and buffer data from a client until there is a query to start, or
+ * until there is nothing left to read; queries are only read while there is
+ * room for them, so that a client can't queue up unlimited queries
+ * return 0 on success, and -1 if the client is disconnected or has shut down
+ * its end and been sent everything it asked for
+ */
+static int read_client(ClientBuffer *c) {
+    while(c->readable && !c->eof && client_wants_input(c)) {
+        /* grow the buffer if it is full (keeping space for a nul byte) */
+        if(c->nbytes + 1 == c->nallocd) {
+            c->nallocd *= 2;
+            c->buf = realloc(c->buf, c->nallocd);
+        }
+
+        /* read into the buffer, along with any files passed for bulk
+         * results
+         */
+        struct iovec iov = { c->buf + c->nbytes, c->nallocd - c->nbytes - 1 };
+        char cbuf[CMSG_SPACE(MAX_REQUESTS * sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
 
-/* callback for traverse() to give search results to clients */
-/* TODO: if this is slow, build it into traverse() */
-/* TODO: regex search */
-static int search(const char *path) {
-    if(strstr(path, search_term)) {
         int n;
+        if((n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                c->readable = 0;
+                return 0;
+            }
+            if(n < 0) {
+                perror("recvmsg");
+                return -1;
+            }
 
-        while((n = write(search_fd, path, strlen(path))) == -1
-                && (errno == EAGAIN || errno == EINTR));
-        if(n == -1)
-            return n;
+            /* the client may only have shut down its end, and still be
+             * waiting for results
+             */
+            c->eof = 1;
+            break;
+        }
+
+        keep_client_fds(c, &msg);
 
-        char nl = '\n';
+        /* binary clients always start with a 0 byte */
+        if(c->proto == PROTO_UNKNOWN)
+            c->proto = c->buf[0] ? PROTO_LINE : PROTO_BINARY;
 
-        while((n = write(search_fd, &nl, 1)) == -1
-                && (errno == EAGAIN || errno == EINTR));
-        if(n == -1)
-            return n;
+        c->nbytes += n;
+        c->buf[c->nbytes] = '\0';
     }
 
-    return 0;
+    return client_finished(c) ? -1 : 0;
 }
 
-/* read and buffer data from a client, and when an endline is encountered do
- * the search
+/* return 1 if the client has a search that can make progress (i.e. is not
+ * waiting for the client to read results or for the workers) or a query to
+ * start, and 0 otherwise
+ */
+static int client_has_work(ClientBuffer *c) {
+    Request *r;
+
+    /* it only needs closing */
+    if(client_finished(c))
+        return 1;
+
+    for(r = c->request; r; r = r->next)
+        if(r->search && !r->waiting && search_runnable(r->search, &c->out))
+            return 1;
+
+    switch(c->proto) {
+        case PROTO_LINE:
+            return !c->request && user_may_query(c->user)
+                && !outbuffer_full(&c->out) && strchr(c->buf, '\n');
+        case PROTO_BINARY:
+            return frame_startable(c);
+        default:
+            return 0;
+    }
+}
+
+/* handle an epoll event for the client on fd
  * return 0 on success and -1 if the client is disconnected
  */
-int handle_client_data(TreeNode *root, int fd) {
+static int handle_client_event(TreeNode *root, int fd, uint32_t events) {
     ClientBuffer *c;
 
     HASH_FIND_INT(fd_hash, &fd, c);
 
-    /* if there isn't a buffer yet, make one */
-    if(!c) {
-        c = new_clientbuffer(fd);
-        HASH_ADD_INT(fd_hash, fd, c);
-    }
+    if(!c)
+        return 0;
 
-    /* grow the buffer if it is full */
-    if(c->nbytes == c->nallocd) {
-        c->nallocd *= 2;
-        c->buf = realloc(c->buf, c->nallocd);
+    if(events & (EPOLLERR | EPOLLHUP)) {
+        close_client(c);
+        return -1;
     }
 
-    /* read into the buffer */
-    int n;
-    if((n = read(c->fd, c->buf + c->nbytes, c->nallocd - c->nbytes - 1))
-            <= 0) {
-        if(n < 0)
-            perror("read");
+    /* this is edge-triggered, so remember that there is something to read
+     * in case we can't read it yet
+     */
+    if(events & EPOLLIN)
+        c->readable = 1;
+
+    if(((events & EPOLLOUT) && flush_outbuffer(c) == -1)
+            || read_client(c) == -1) {
+        close_client(c);
         return -1;
     }
 
-    c->nbytes += n;
-    c->buf[c->nbytes] = '\0';
+    schedule_client(c);
 
-    /* if we get an endline, do a search */
-    char *end;
-    while((end = strchr(c->buf, '\n'))) {
-        *end = '\0';
-
-        /* set up information for search() callback */
-        search_fd = c->fd;
-        search_term = c->buf;
+    return 0;
+}
 
-        /* do the search */
-        /* TODO: timing */
-        traverse(root, "/", search);
+/* start any queries the client has sent, and get on with its searches: pass on
+ * the results that are ready, and either give the parts that can run to the
+ * workers or, if there are no workers, run a slice of SEARCH_SLICE nodes here;
+ * then send whatever results can be sent, and read more from the client if
+ * there is room for more queries
+ * return 0 on success and -1 if the client is disconnected
+ */
+static int handle_client_work(TreeNode *root, ClientBuffer *c) {
+    if(c->proto == PROTO_BINARY) {
+        if(handle_frames(root, c) == -1)
+            return -1;
+    } else {
+        start_line_queries(root, c);
+    }
 
-        /* write a final endline to the client */
-        char nl = '\n';
-        write(c->fd, &nl, 1);
+    Request *r, *next;
+    for(r = c->request; r && !outbuffer_full(&c->out); r = next) {
+        next = r->next;
+        if(r->search && !r->waiting)
+            step_request(r);
+    }
 
-        /* move the rest of the buffer back to the start */
-        memmove(c->buf, end+1, c->nbytes + c->buf - end + 1);
-        c->nbytes -= end - c->buf + 1;
+    /* start with a different request next time so that they take turns at
+     * filling the client's queue
+     */
+    if(c->request && c->request->next) {
+        Request *first = c->request;
+        c->request = first->next;
+        for(r = c->request; r->next; r = r->next);
+        r->next = first;
+        first->next = NULL;
     }
 
-    return 0;
+    if(flush_outbuffer(c) == -1)
+        return -1;
+
+    return read_client(c);
+}
+
+/* take back the search parts that workers have finished running slices of,
+ * and send the clients their results
+ */
+void handle_worker_events(void) {
+    SearchPart *p;
+
+    while((p = finished_work())) {
+        Search *s = p->search;
+        Request *r = s->request;
+
+        p->busy = 0;
+        s->nbusy--;
+
+        /* snapshots aren't for a client, and get on by themselves, and
+         * cancelled searches are only waiting to be freed
+         */
+        if(!r) {
+            if(s->cancelled && !s->nbusy)
+                free_search(s);
+            continue;
+        }
+
+        ClientBuffer *c = r->client;
+
+        step_request(r);
+
+        if(flush_outbuffer(c) == -1 || read_client(c) == -1)
+            close_client(c);
+        else
+            schedule_client(c);
+    }
 }
@@ -0,0 +1,235 @@
+/* Statistics for jfindd
+ *
+ * Counters are kept where the things they count happen; this keeps the
+ * histograms of how long things take, and puts everything together as text
+ * in the Prometheus exposition format for JF_MSG_STATS (see protocol.h), so
+ * that "jfind -s" can feed a textfile collector or be read by hand.
+ *
+ * James Stanley 2012
+ */
+
+#include <malloc.h>
+
+#include "jfindd.h"
+
+/* a histogram with a count for each upper bound, and one for above them */
+typedef struct Histogram {
+    const double *bound;
+    int nbounds;
+    unsigned long count[32];
+    double sum;
+} Histogram;
+
+static const double seconds_bounds[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+    0.25, 0.5, 1, 2.5, 5, 10, 30, 60
+};
+
+static const double nodes_bounds[] = {
+    10, 100, 1000, 10000, 100000, 1000000, 10000000
+};
+
+#define NBOUNDS(b) (sizeof(b) / sizeof(double))
+
+static Histogram query_seconds = { seconds_bounds, NBOUNDS(seconds_bounds) };
+static Histogram query_nodes = { nodes_bounds, NBOUNDS(nodes_bounds) };
+static Histogram reindex_seconds = { seconds_bounds, NBOUNDS(seconds_bounds) };
+
+static unsigned long nindexes;/* times the whole tree has been indexed */
+static double index_seconds;/* how long the latest of those took */
+
+/* return the number of seconds since the given time */
+double seconds_since(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/* count the value in the histogram */
+static void observe(Histogram *h, double v) {
+    int i;
+
+    for(i = 0; i < h->nbounds && v > h->bound[i]; i++);
+    h->count[i]++;
+    h->sum += v;
+}
+
+/* count the request, whose search has finished or been abandoned */
+void count_query(Request *r) {
+    Search *s = r->search;
+    long n = 0;
+    int i;
+
+    /* parts that workers are running can't be looked at */
+    for(i = 0; i < s->nparts; i++)
+        if(!s->part[i].busy)
+            n += s->part[i].nvisited;
+
+    observe(&query_seconds, seconds_since(&r->started));
+    observe(&query_nodes, n);
+
+    PROBE3(query_end, s, search_results(s), n);
+}
+
+/* count a pass of reindex() that took the given number of seconds */
+void count_reindex(double secs) {
+    observe(&reindex_seconds, secs);
+}
+
+/* count an index of the whole tree that took the given number of seconds */
+void count_index(double secs) {
+    nindexes++;
+    index_seconds = secs;
+}
+
+/* append printf()ed text to the OutBuffer */
+static void append_printf(OutBuffer *o, const char *fmt, ...) {
+    char buf[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if(n >= sizeof(buf))
+        n = sizeof(buf) - 1;
+    append_outbuffer(o, buf, n);
+}
+
+/* append the HELP and TYPE lines for a metric */
+static void append_meta(OutBuffer *o, const char *name, const char *type,
+        const char *help) {
+    append_printf(o, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* append a value; whole numbers are printed exactly, however big */
+static void append_value(OutBuffer *o, double v) {
+    append_printf(o, v == (long)v ? " %.17g\n" : " %.9g\n", v);
+}
+
+/* append a metric with a single value */
+static void append_metric(OutBuffer *o, const char *name, const char *type,
+        const char *help, double v) {
+    append_meta(o, name, type, help);
+    append_printf(o, "%s", name);
+    append_value(o, v);
+}
+
+/* append a histogram, whose buckets are cumulative */
+static void append_histogram(OutBuffer *o, const char *name, const char *help,
+        Histogram *h) {
+    unsigned long n = 0;
+    int i;
+
+    append_meta(o, name, "histogram", help);
+    for(i = 0; i < h->nbounds; i++) {
+        n += h->count[i];
+        append_printf(o, "%s_bucket{le=\"%g\"} %lu\n", name, h->bound[i], n);
+    }
+    n += h->count[i];
+    append_printf(o, "%s_bucket{le=\"+Inf\"} %lu\n", name, n);
+    append_printf(o, "%s_sum", name);
+    append_value(o, h->sum);
+    append_printf(o, "%s_count %lu\n", name, n);
+}
+
+/* append the statistics for the tree under root to the OutBuffer */
+void append_stats(TreeNode *root, OutBuffer *o) {
+    append_histogram(o, "jfindd_query_duration_seconds",
+            "Time from receiving a search to its last result.",
+            &query_seconds);
+    append_histogram(o, "jfindd_query_nodes_visited",
+            "Nodes each search visited.", &query_nodes);
+    append_metric(o, "jfindd_cache_hits_total", "counter",
+            "Queries answered from the cache.", cache_hits);
+    append_metric(o, "jfindd_cache_misses_total", "counter",
+            "Queries that had to search the tree.", cache_misses);
+
+    append_metric(o, "jfindd_inotify_events_total", "counter",
+            "Inotify events read.", inotify_events);
+    append_metric(o, "jfindd_inotify_events_coalesced_total", "counter",
+            "Inotify events dropped because later ones cancelled them out.",
+            inotify_coalesced);
+    append_metric(o, "jfindd_inotify_events_per_second", "gauge",
+            "Inotify events read in the last second.", inotify_rate);
+    append_metric(o, "jfindd_inotify_overflows_total", "counter",
+            "Times the kernel's inotify queue overflowed.",
+            inotify_overflows);
+    append_metric(o, "jfindd_inotify_reader_stalls_total", "counter",
+            "Times the reader thread found its ring buffer full.",
+            inotify_stalls);
+    append_metric(o, "jfindd_inotify_backlog_bytes", "gauge",
+            "Bytes of events read but not yet handled.", reader_backlog());
+    append_metric(o, "jfindd_inotify_backlog_peak_bytes", "gauge",
+            "Most bytes of events there have been waiting to be handled.",
+            inotify_peak);
+
+    append_metric(o, "jfindd_indexes_total", "counter",
+            "Times the whole tree has been indexed.", nindexes);
+    append_metric(o, "jfindd_index_duration_seconds", "gauge",
+            "How long the latest index of the whole tree took.",
+            index_seconds);
+    append_histogram(o, "jfindd_reindex_duration_seconds",
+            "How long each pass over the directories queued to be "
+            "reindexed took.", &reindex_seconds);
+    append_metric(o, "jfindd_reindexed_nodes_total", "counter",
+            "Nodes that have been reindexed.", nreindexed);
+    append_metric(o, "jfindd_reindex_queue", "gauge",
+            "Nodes waiting to be reindexed.", ndirty);
+
+    append_metric(o, "jfindd_watches", "gauge",
+            "Directories watched with inotify.", watch_count());
+    append_metric(o, "jfindd_watches_max", "gauge",
+            "Most inotify watches jfindd will use.", max_watches);
+    append_metric(o, "jfindd_polled_directories", "gauge",
+            "Directories polled because they couldn't be watched.", npolled);
+    append_metric(o, "jfindd_poller_rescans_total", "counter",
+            "Polled directories read again because they had changed.",
+            poller_rescans);
+    append_metric(o, "jfindd_poller_promotions_total", "counter",
+            "Polled directories given a watch.", poller_promotions);
+    append_metric(o, "jfindd_poller_demotions_total", "counter",
+            "Watched directories given up to be polled.", poller_demotions);
+    append_metric(o, "jfindd_moves_paired_total", "counter",
+            "Nodes moved within the tree.", moves_paired);
+    append_metric(o, "jfindd_moves_expired_total", "counter",
+            "Nodes moved out of the tree.", moves_expired);
+    append_metric(o, "jfindd_moves_pending", "gauge",
+            "Moves waiting for their IN_MOVED_TO.", nmoves);
+
+    append_metric(o, "jfindd_nodes", "gauge",
+            "Nodes in the tree.", root->dir->nnodes);
+    append_metric(o, "jfindd_directories", "gauge",
+            "Directories in the tree, and waiting to be freed.", ndirinfos);
+
+    append_meta(o, "jfindd_memory_bytes", "gauge",
+            "Memory allocated for each kind of structure.");
+    append_printf(o, "jfindd_memory_bytes{structure=\"treenode\"} %lu\n",
+            ntreenodes * sizeof(TreeNode));
+    append_printf(o, "jfindd_memory_bytes{structure=\"name\"} %lu\n",
+            name_bytes);
+    append_printf(o, "jfindd_memory_bytes{structure=\"dirinfo\"} %lu\n",
+            ndirinfos * sizeof(DirInfo));
+    append_printf(o, "jfindd_memory_bytes{structure=\"childarray\"} %lu\n",
+            childarray_bytes);
+    append_printf(o, "jfindd_memory_bytes{structure=\"cache\"} %ld\n",
+            cache_bytes);
+    append_printf(o, "jfindd_memory_bytes{structure=\"journal\"} %lu\n",
+            journal_bytes);
+    append_printf(o, "jfindd_memory_bytes{structure=\"inotify_ring\"} %d\n",
+            INOTIFY_RING_SIZE);
+    append_printf(o, "jfindd_memory_bytes{structure=\"client\"} %lu\n",
+            client_bytes());
+    struct mallinfo2 mi = mallinfo2();
+    append_metric(o, "jfindd_heap_bytes", "gauge",
+            "Memory allocated with malloc() altogether.",
+            mi.uordblks + mi.hblkhd);
+
+    append_metric(o, "jfindd_clients", "gauge",
+            "Clients connected.", client_count());
+    append_metric(o, "jfindd_users", "gauge",
+            "Users with clients connected.", user_count());
+}
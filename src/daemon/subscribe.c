@@ -0,0 +1,221 @@
+/* Live query subscriptions for jfindd
+ *
+ * The tree functions tell us about every node that is added or removed, and
+ * the paths in the subtree are matched against each subscribed term as it
+ * happens. Deltas are collected per subscription and passed on to the
+ * clients once a batch of inotify events has been dealt with.
+ *
+ * James Stanley 2012
+ */
+
+#include "jfindd.h"
+
+static SubscriptionTerm *term_hash;
+static int npending;/* number of subscriptions with deltas to pass on */
+
+/* subscribe the request to changes to paths under "path" that contain term */
+Subscription *subscribe(Request *r, const char *term, const char *path) {
+    Subscription *s = malloc(sizeof(Subscription));
+    SubscriptionTerm *st;
+
+    memset(s, 0, sizeof(Subscription));
+
+    s->request = r;
+    s->prefix = strdup(path);
+    if(*s->prefix && s->prefix[strlen(s->prefix)-1] == '/')
+        s->prefix[strlen(s->prefix)-1] = '\0';
+
+    /* add it to the subscriptions to this term */
+    HASH_FIND_STR(term_hash, term, st);
+    if(!st) {
+        st = malloc(sizeof(SubscriptionTerm));
+        memset(st, 0, sizeof(SubscriptionTerm));
+        st->term = strdup(term);
+        HASH_ADD_KEYPTR(hh, term_hash, st->term, strlen(st->term), st);
+    }
+
+    s->term = st;
+    s->next = st->sub;
+    st->sub = s;
+
+    return s;
+}
+
+/* stop sending deltas for the subscription and free it */
+void unsubscribe(Subscription *s) {
+    SubscriptionTerm *st = s->term;
+
+    Subscription **p;
+    for(p = &st->sub; *p != s; p = &(*p)->next);
+    *p = s->next;
+
+    /* forget the term if nobody is subscribed to it any more */
+    if(!st->sub) {
+        HASH_DEL(term_hash, st);
+        free(st->term);
+        free(st);
+    }
+
+    if(s->pending.nbytes)
+        npending--;
+
+    free(s->pending.buf);
+    free(s->prefix);
+    free(s);
+}
+
+/* queue the subscription's deltas for its client, split into JF_MSG_DELTA
+ * frames of at most OUTBUF_SIZE bytes, and forget them
+ * return 0 on success, and -1 without queueing anything if they would leave
+ * the client with more than SUBSCRIBE_BACKLOG bytes of unread output
+ */
+static int append_deltas(Subscription *s) {
+    Request *r = s->request;
+    OutBuffer *o = &r->client->out;
+    char *buf = s->pending.buf;
+    int n = s->pending.nbytes;
+    int start, end;
+
+    s->pending.start = s->pending.nbytes = 0;
+    npending--;
+
+    if(o->nbytes - o->start + n > SUBSCRIBE_BACKLOG)
+        return -1;
+
+    /* each delta is a sign, a path and a nul, and is never split */
+    for(start = 0; start < n; start = end) {
+        for(end = start; end < n; ) {
+            int len = strlen(buf + end) + 1;
+            if(end > start && end + len - start > OUTBUF_SIZE)
+                break;
+            end += len;
+        }
+
+        append_frame(o, JF_MSG_DELTA, JF_STATUS_OK, r->id, buf + start,
+                end - start);
+    }
+
+    return 0;
+}
+
+/* queue the deltas that were collected while the initial results were being
+ * sent, and pass on deltas as they happen from now on
+ */
+void sync_subscription(Subscription *s) {
+    Request *r = s->request;
+
+    s->synced = 1;
+
+    if(s->pending.nbytes && append_deltas(s) == -1) {
+        append_done(&r->client->out, r->id, JF_STATUS_OVERFLOW, 0,
+                "too many changes during initial results");
+        end_request(r);
+    }
+}
+
+/* return 1 if the path is under the subscription's path and 0 otherwise */
+static int under_prefix(Subscription *s, const char *path) {
+    int len = strlen(s->prefix);
+
+    return strncmp(path, s->prefix, len) == 0
+        && (path[len] == '\0' || path[len] == '/');
+}
+
+/* add a delta for every path in the subtree rooted at t that a subscription
+ * matches; "sign" is '+' or '-'
+ */
+static void notify(TreeNode *t, char sign) {
+    if(!term_hash)
+        return;
+
+    char *parentpath = treenode_name(t->parent);
+    Traversal *tr = new_node_traversal(t, parentpath, 1);
+    free(parentpath);
+
+    char *path;
+    while(traversal_next(tr, &path)) {
+        SubscriptionTerm *st, *tmp;
+
+        HASH_ITER(hh, term_hash, st, tmp) {
+            if(!strstr(path, st->term))
+                continue;
+
+            Subscription *s;
+            for(s = st->sub; s; s = s->next) {
+                if(!under_prefix(s, path))
+                    continue;
+
+                if(!s->pending.nbytes)
+                    npending++;
+                append_outbuffer(&s->pending, &sign, 1);
+                append_outbuffer(&s->pending, path, strlen(path) + 1);
+            }
+        }
+    }
+
+    free_traversal(tr);
+}
+
+/* tell subscribers about the subtree rooted at t, which has just been added
+ * to the tree
+ */
+void notify_added(TreeNode *t) {
+    notify(t, '+');
+}
+
+/* tell subscribers about the subtree rooted at t, which is about to be
+ * removed from the tree
+ */
+void notify_removed(TreeNode *t) {
+    notify(t, '-');
+}
+
+/* pass on the collected deltas to the clients of subscriptions that have
+ * sent their initial results, and drop subscriptions whose clients have too
+ * much unread output
+ */
+void flush_subscriptions(void) {
+    SubscriptionTerm *st, *tmp;
+
+    if(!npending)
+        return;
+
+    HASH_ITER(hh, term_hash, st, tmp) {
+        Subscription *s, *next;
+
+        for(s = st->sub; s; s = next) {
+            next = s->next;
+
+            Request *r = s->request;
+            ClientBuffer *c = r->client;
+
+            if(!s->pending.nbytes)
+                continue;
+
+            /* deltas wait until the initial results have been sent, but not
+             * forever
+             */
+            if(!s->synced) {
+                if(s->pending.nbytes > SUBSCRIBE_BACKLOG
+                        && !r->search->nbusy) {
+                    append_done(&c->out, r->id, JF_STATUS_OVERFLOW, 0,
+                            "too many changes during initial results");
+                    end_request(r);
+                    send_client_output(c);
+                }
+                continue;
+            }
+
+            if(append_deltas(s) == -1) {
+                append_done(&c->out, r->id, JF_STATUS_OVERFLOW, 0,
+                        "too many unread changes");
+                /* this frees s, and st too if s was its last subscription,
+                 * but not the next one
+                 */
+                end_request(r);
+            }
+
+            send_client_output(c);
+        }
+    }
+}
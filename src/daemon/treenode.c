@@ -7,6 +7,32 @@
 
 DirInfo *wd_hash;
 
+/* incremented every time the tree changes */
+unsigned long tree_generation;
+
+unsigned long ntreenodes;/* TreeNodes allocated */
+unsigned long name_bytes;/* bytes of their names */
+unsigned long childarray_bytes;/* bytes of ChildArrays in the tree */
+
+/* things that were removed from the tree while it was held, oldest first,
+ * with the function to free each one and the generation at which it was
+ * removed
+ */
+typedef struct Retired {
+    void *p;
+    void (*free)(void *);
+    unsigned long gen;
+} Retired;
+
+static Retired *retired;
+static int nretired;
+static int nretiredallocd;
+
+/* the generation at which each hold on the tree was taken */
+static unsigned long *holdgen;
+static int nholds;
+static int nholdsallocd;
+
 /* allocate a new treenode with the given name */
 TreeNode *new_treenode(const char *name) {
     TreeNode *t = malloc(sizeof(TreeNode));
@@ -16,23 +42,91 @@ TreeNode *new_treenode(const char *name) {
     memset(t, 0, sizeof(TreeNode));
     t->name = strdup(name);
 
+    ntreenodes++;
+    name_bytes += strlen(name) + 1;
+
     return t;
 }
 
+/* return the number of bytes a ChildArray with space for nallocd children
+ * takes up
+ */
+int childarray_size(int nallocd) {
+    return sizeof(ChildArray) + nallocd * sizeof(TreeNode *);
+}
+
+/* allocate a ChildArray with space for nallocd children, containing the
+ * children from the given array (if any)
+ */
+static ChildArray *new_childarray(ChildArray *from, int nallocd) {
+    ChildArray *a = malloc(childarray_size(nallocd));
+
+    childarray_bytes += childarray_size(nallocd);
+
+    a->nchilds = 0;
+    a->nallocd = nallocd;
+    a->nremoved = 0;
+
+    /* copy the children over, leaving out removed ones */
+    int i;
+    for(i = 0; from && i < from->nchilds; i++)
+        if(from->child[i])
+            a->child[a->nchilds++] = from->child[i];
+
+    return a;
+}
+
+/* replace the child array of the given directory with a new one with space
+ * for nallocd children; the old array is retired because traversals in other
+ * threads may still be reading it
+ */
+static void replace_childarray(DirInfo *d, int nallocd) {
+    ChildArray *old = d->children;
+
+    STORE_SHARED(d->children, new_childarray(old, nallocd));
+    if(old)
+        childarray_bytes -= childarray_size(old->nallocd);
+    retire(old, free);
+}
+
+/* add n to the node counts of t and all of the directories above it, and
+ * mark them as changed now
+ */
+static void count_nodes(TreeNode *t, int n) {
+    for(; t; t = t->parent) {
+        t->dir->nnodes += n;
+        t->dir->changed = tree_generation;
+    }
+}
+
 /* add the given child to the given node (which must be a directory) */
 void add_child(TreeNode *t, TreeNode *child) {
     assert(t->dir);/* the parent node must be a directory */
     assert(!child->parent);/* the child node must not already have a parent */
 
-    /* we could double the size of t->dir->child as necessary, but since
-     * TreeNodes are only actually manipulated in I/O-bound situations, that
-     * gains little and wastes quite a bit of memory
+    /* traversals in other threads read the child array without locking, so
+     * it can't be realloc()d; instead it grows in steps of a half and a new
+     * array is made when it is full (which also drops removed children)
      */
+    ChildArray *a = t->dir->children;
+    if(!a || a->nchilds == a->nallocd) {
+        int nlive = a ? a->nchilds - a->nremoved : 0;
+        replace_childarray(t->dir, nlive + nlive / 2 + 4);
+        a = t->dir->children;
+    }
 
-    t->dir->child = realloc(t->dir->child,
-            (t->dir->nchilds + 1) * sizeof(TreeNode*));
-    t->dir->child[t->dir->nchilds++] = child;
+    /* fill in the slot before making it visible */
+    STORE_SHARED(a->child[a->nchilds], child);
+    STORE_SHARED(a->nchilds, a->nchilds + 1);
     child->parent = t;
+
+    tree_generation++;
+
+    count_nodes(t, 1 + (child->dir ? child->dir->nnodes : 0));
+    if(child->dir)
+        child->dir->added = tree_generation;
+
+    notify_added(child);
 }
 
 /* lookup the given path, starting at the given node, and return the node
@@ -53,14 +147,17 @@ TreeNode *lookup_treenode(TreeNode *t, char *path, int create) {
         if((endpath = strchr(path, '/')))
             *endpath = '\0';
 
-        /* store nchilds because t gets updated to point at a different node */
-        int nchilds = t->dir->nchilds;
+        /* store the array because t gets updated to point at a different
+         * node
+         */
+        ChildArray *a = t->dir->children;
+        int nchilds = a ? a->nchilds : 0;
 
         int i;
         for(i = 0; i < nchilds; i++) {
-            if(strcmp(t->dir->child[i]->name, path) == 0) {
+            if(a->child[i] && strcmp(a->child[i]->name, path) == 0) {
                 /* move on to the child */
-                t = t->dir->child[i];
+                t = a->child[i];
                 break;
             }
         }
@@ -75,7 +172,7 @@ TreeNode *lookup_treenode(TreeNode *t, char *path, int create) {
             add_child(t, child);
 
             if(endpath)
-                child->dir = new_dirinfo(child);
+                STORE_SHARED(child->dir, new_dirinfo(child));
 
             t = child;
         }
@@ -100,24 +197,32 @@ TreeNode *lookup_treenode(TreeNode *t, char *path, int create) {
 void remove_treenode(TreeNode *t) {
     assert(t->parent);/* if t doesn't have a parent we can't remove it */
 
+    notify_removed(t);
+
+    ChildArray *a = t->parent->dir->children;
+
     /* locate this child */
     int i;
-    for(i = 0; i < t->parent->dir->nchilds; i++)
-        if(t->parent->dir->child[i] == t)
+    for(i = 0; i < a->nchilds; i++)
+        if(a->child[i] == t)
             break;
 
-    assert(i != t->parent->dir->nchilds);/* the child must be found */
+    assert(i != a->nchilds);/* the child must be found */
 
-    /* move the remaining children towards the start of the child array by
-     * one element
+    /* leave a hole where the child was, since traversals in other threads
+     * may be part way through the array, and make a new array once more than
+     * half of it is holes
      */
-    memmove(t->parent->dir->child + i, t->parent->dir->child + i + 1,
-            sizeof(TreeNode*) * (t->parent->dir->nchilds - i - 1));
+    STORE_SHARED(a->child[i], NULL);
+    a->nremoved++;
+    if(a->nremoved > a->nchilds / 2) {
+        int nlive = a->nchilds - a->nremoved;
+        replace_childarray(t->parent->dir, nlive + nlive / 2 + 4);
+    }
+
+    tree_generation++;
 
-    /* reallocate the array */
-    t->parent->dir->nchilds--;
-    t->parent->dir->child = realloc(t->parent->dir->child,
-            t->parent->dir->nchilds * sizeof(TreeNode*));
+    count_nodes(t->parent, -1 - (t->dir ? t->dir->nnodes : 0));
 
     /* t no longer has a parent */
     t->parent = NULL;
@@ -181,7 +286,114 @@ void free_treenode(TreeNode *t) {
     if(!t)
         return;
 
+    if(t->dirty)
+        unmark_dirty(t);
     free_dirinfo(t->dir);
+    ntreenodes--;
+    name_bytes -= strlen(t->name) + 1;
     free(t->name);
     free(t);
 }
+
+/* free_treenode() for retire() */
+static void _free_treenode(void *p) {
+    free_treenode(p);
+}
+
+/* change the name of the given node; the old name is retired because
+ * traversals in other threads may be reading it
+ */
+void rename_treenode(TreeNode *t, const char *name) {
+    char *old = t->name;
+
+    STORE_SHARED(t->name, strdup(name));
+    name_bytes += strlen(name) - strlen(old);
+    retire(old, free);
+
+    tree_generation++;
+
+    /* the paths of everything below have changed too */
+    if(t->parent)
+        count_nodes(t->parent, 0);
+    if(t->dir)
+        t->dir->added = tree_generation;
+}
+
+/* free p with the given function once nothing can be looking at it any more;
+ * traversals keep pointers into the tree, and read it from other threads, so
+ * anything removed while the tree is held is only freed once every hold taken
+ * before the removal has been released
+ */
+void retire(void *p, void (*freefunc)(void *)) {
+    if(!p)
+        return;
+
+    if(!nholds) {
+        freefunc(p);
+        return;
+    }
+
+    if(nretired == nretiredallocd) {
+        nretiredallocd = nretiredallocd ? nretiredallocd * 2 : 64;
+        retired = realloc(retired, nretiredallocd * sizeof(Retired));
+    }
+    retired[nretired].p = p;
+    retired[nretired].free = freefunc;
+    retired[nretired].gen = ++tree_generation;
+    nretired++;
+}
+
+/* free the given node (which must already have been removed from the tree)
+ * once nothing can be looking at it any more
+ */
+void retire_treenode(TreeNode *t) {
+    if(!t)
+        return;
+
+    assert(!t->parent);/* the node must not still be in the tree */
+
+    retire(t, _free_treenode);
+}
+
+/* stop nodes retired from now on from being freed until the hold is released
+ * with release_treenodes(); returns the generation to pass to it
+ */
+unsigned long hold_treenodes(void) {
+    if(nholds == nholdsallocd) {
+        nholdsallocd = nholdsallocd ? nholdsallocd * 2 : 16;
+        holdgen = realloc(holdgen, nholdsallocd * sizeof(unsigned long));
+    }
+    holdgen[nholds++] = tree_generation;
+
+    return tree_generation;
+}
+
+/* release a hold taken with hold_treenodes(), and free the retired nodes that
+ * no remaining hold can see
+ */
+void release_treenodes(unsigned long gen) {
+    int i;
+
+    /* forget this hold */
+    for(i = 0; i < nholds; i++)
+        if(holdgen[i] == gen)
+            break;
+    assert(i != nholds);/* there must be a hold to release */
+    holdgen[i] = holdgen[--nholds];
+
+    /* find the oldest remaining hold */
+    unsigned long oldest = tree_generation;
+    for(i = 0; i < nholds; i++)
+        if(holdgen[i] < oldest)
+            oldest = holdgen[i];
+
+    /* things removed before the oldest hold was taken can't be seen by any
+     * traversal
+     */
+    for(i = 0; i < nretired && retired[i].gen <= oldest; i++)
+        retired[i].free(retired[i].p);
+    if(!i)
+        return;
+    memmove(retired, retired + i, (nretired - i) * sizeof(Retired));
+    nretired -= i;
+}
@@ -0,0 +1,156 @@
+/* Share jfindd out between the users connected to it
+ *
+ * Clients are grouped by the uid at the other end of the socket, so that a
+ * user can't get more than their share by opening more connections: each
+ * user can only have so many clients and queries at once, and the run queue
+ * gives each user a turn per pass rather than each client.
+ *
+ * Only MAX_EXPENSIVE searches of big subtrees run at once. The rest wait, and
+ * when one finishes, the next to go is the oldest waiting search of whichever
+ * user has the fewest expensive searches running. Cheap searches never wait.
+ *
+ * James Stanley 2012
+ */
+
+#include "jfindd.h"
+
+static User *user_hash;
+
+static Request *waiting;/* requests waiting to run, oldest first */
+static int nexpensive;/* expensive searches running */
+
+/* return the User for the uid, counting one more client for it */
+User *add_user_client(uid_t uid) {
+    User *u;
+
+    HASH_FIND(hh, user_hash, &uid, sizeof(uid_t), u);
+    if(!u) {
+        u = malloc(sizeof(User));
+        memset(u, 0, sizeof(User));
+        u->uid = uid;
+        HASH_ADD(hh, user_hash, uid, sizeof(uid_t), u);
+    }
+
+    u->nclients++;
+
+    return u;
+}
+
+/* count one less client for the user, and forget it after the last */
+void remove_user_client(User *u) {
+    if(--u->nclients)
+        return;
+
+    HASH_DEL(user_hash, u);
+    free(u);
+}
+
+/* return 1 if the user's clients can start another query, and 0 otherwise */
+int user_may_query(User *u) {
+    return u->nrequests < MAX_USER_REQUESTS;
+}
+
+/* start the clock for the request's search's time limit */
+static void start_clock(Request *r) {
+    clock_gettime(CLOCK_MONOTONIC, &r->search->started);
+    r->search->blocked = client_blocked_seconds(r->client);
+}
+
+/* count the request's search as one of the expensive ones running, and start
+ * its clock
+ */
+static void run_expensive(Request *r) {
+    r->expensive = 1;
+    r->client->user->nexpensive++;
+    nexpensive++;
+
+    start_clock(r);
+}
+
+/* let the newly-made request's search run now if it is cheap or there is
+ * room for another expensive one, and otherwise make it wait
+ */
+void admit_request(Request *r) {
+    if(r->search->size < EXPENSIVE_NODES) {
+        start_clock(r);
+        return;
+    }
+
+    if(nexpensive < MAX_EXPENSIVE) {
+        run_expensive(r);
+        return;
+    }
+
+    Request **p;
+    for(p = &waiting; *p; p = &(*p)->nextwaiting);
+    *p = r;
+    r->waiting = 1;
+}
+
+/* the request's search has finished or been abandoned, so take it off the
+ * waiting queue, or give its place to the next waiting request
+ */
+void release_request(Request *r) {
+    Request **p;
+
+    if(r->waiting) {
+        for(p = &waiting; *p != r; p = &(*p)->nextwaiting);
+        *p = r->nextwaiting;
+        r->waiting = 0;
+        return;
+    }
+
+    if(!r->expensive)
+        return;
+
+    r->expensive = 0;
+    r->client->user->nexpensive--;
+    nexpensive--;
+
+    if(!waiting)
+        return;
+
+    /* the oldest request of the user with the fewest searches running */
+    Request **best = &waiting;
+    for(p = &waiting; *p; p = &(*p)->nextwaiting)
+        if((*p)->client->user->nexpensive
+                < (*best)->client->user->nexpensive)
+            best = p;
+
+    Request *next = *best;
+    *best = next->nextwaiting;
+    next->waiting = 0;
+
+    run_expensive(next);
+    schedule_client(next->client);
+}
+
+/* return the number of users with clients connected */
+int user_count(void) {
+    return HASH_COUNT(user_hash);
+}
+
+/* return why the request's search has to be ended, or NULL if it is still
+ * within its limits
+ */
+const char *request_over_budget(Request *r) {
+    Search *s = r->search;
+
+    /* time spent waiting for the client to read the results doesn't count */
+    if(QUERY_TIME_LIMIT && seconds_since(&s->started)
+            - (client_blocked_seconds(r->client) - s->blocked)
+            > QUERY_TIME_LIMIT)
+        return "query took too long";
+
+    if(QUERY_NODE_LIMIT) {
+        long n = 0;
+        int i;
+        for(i = 0; i < s->nparts; i++)
+            if(!s->part[i].busy)
+                n += s->part[i].nvisited;
+        if(n > QUERY_NODE_LIMIT)
+            return "query visited too many nodes";
+    }
+
+    return NULL;
+}
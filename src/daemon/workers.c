@@ -0,0 +1,117 @@
+/* Worker threads that run searches for jfindd
+ *
+ * The main thread owns the tree and the clients. It hands a part of a search
+ * to a worker to run one slice of it, and doesn't touch the part again until
+ * the worker hands it back. Workers read the tree without locking while the
+ * main thread changes it (see STORE_SHARED and retire()).
+ */
+
+#include "jfindd.h"
+
+int nworkers;
+
+static int wakefd[2];/* workers write a byte here for each finished slice */
+static int nbusy;/* number of parts handed to workers (main thread only) */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static SearchPart *todo;/* parts waiting for a worker */
+static SearchPart *todotail;
+static SearchPart *done;/* parts whose slice has finished */
+
+/* run search slices for parts from the todo list, forever */
+static void *worker(void *arg) {
+    while(1) {
+        /* wait for a part */
+        pthread_mutex_lock(&lock);
+        while(!todo)
+            pthread_cond_wait(&cond, &lock);
+        SearchPart *p = todo;
+        todo = p->next;
+        if(!todo)
+            todotail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        run_search_part(p, SEARCH_SLICE);
+
+        /* give it back to the main thread */
+        pthread_mutex_lock(&lock);
+        p->next = done;
+        done = p;
+        pthread_mutex_unlock(&lock);
+
+        char b = 0;
+        while(write(wakefd[1], &b, 1) == -1 && errno == EINTR);
+    }
+
+    return NULL;
+}
+
+/* start the given number of worker threads, printing a message and dying if
+ * there is a problem
+ */
+void init_workers(int n) {
+    if(pipe(wakefd) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(wakefd[0], F_SETFL, fcntl(wakefd[0], F_GETFL) | O_NONBLOCK);
+
+    int i;
+    for(i = 0; i < n; i++) {
+        pthread_t thread;
+        int err;
+        if((err = pthread_create(&thread, NULL, worker, NULL))) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+
+    nworkers = n;
+}
+
+/* return the fd that becomes readable when a worker has finished a slice */
+int worker_fd(void) {
+    return wakefd[0];
+}
+
+/* return the number of parts that have been given to workers and not yet
+ * given back by finished_work()
+ */
+int workers_busy(void) {
+    return nbusy;
+}
+
+/* give the part to a worker to run a slice of it */
+void submit_work(SearchPart *p) {
+    nbusy++;
+
+    pthread_mutex_lock(&lock);
+    p->next = NULL;
+    if(todotail)
+        todotail->next = p;
+    else
+        todo = p;
+    todotail = p;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/* return a part whose slice has finished, or NULL if there are none */
+SearchPart *finished_work(void) {
+    /* empty the pipe; there is a byte for every part on the done list */
+    char buf[256];
+    while(read(wakefd[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&lock);
+    SearchPart *p = done;
+    if(p)
+        done = p->next;
+    pthread_mutex_unlock(&lock);
+
+    if(p)
+        nbusy--;
+
+    return p;
+}
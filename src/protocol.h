@@ -0,0 +1,130 @@
+/* Binary protocol for jfind
+ *
+ * A connection speaks either the line protocol (a query line in, paths out
+ * one per line, and a blank line at the end) or this binary protocol; the
+ * daemon tells them apart by the first byte, which is always 0 for a binary
+ * client.
+ *
+ * Every message is a frame: a header of JF_HEADER_SIZE bytes followed by
+ * "length" bytes of payload. All integers are big-endian.
+ *
+ *   uint32 length  length of the payload (at most JF_MAX_FRAME)
+ *   uint16 type    JF_MSG_*
+ *   uint16 status  JF_STATUS_* in replies, 0 in requests
+ *   uint32 id      chosen by the client for each query; replies carry the id
+ *                  of the query they belong to, so that several queries can
+ *                  be in flight on one connection at once
+ *
+ * The client starts with JF_MSG_HELLO, whose payload is a uint32 protocol
+ * version; the daemon replies with JF_MSG_HELLO carrying its own version and
+ * JF_STATUS_BAD_VERSION if it can't speak the client's.
+ *
+ * JF_MSG_QUERY has a payload of options, each of which is a uint16 option
+ * type (JF_OPT_*), a uint16 length, and that many bytes of value. The daemon
+ * replies with any number of JF_MSG_RESULTS, whose payload is matching paths
+ * each terminated by a nul byte, and then one JF_MSG_DONE, whose payload is
+ * a uint32 count of the results followed by an error message if the status
+ * is not JF_STATUS_OK.
+ *
+ * A query with JF_OPT_SUBSCRIBE set keeps going after its initial results:
+ * instead of JF_MSG_DONE, the end of the initial results is marked by
+ * JF_MSG_SYNCED (whose payload is the uint32 count), and then JF_MSG_DELTA
+ * frames follow as the tree changes. Their payload is paths each starting
+ * with '+' (now matches) or '-' (no longer exists) and terminated by a nul
+ * byte. Applying the results and then the deltas to a set, in the order they
+ * arrive, gives the current matches. A subscription ends with JF_MSG_DONE
+ * only if the daemon gives up on it (JF_STATUS_OVERFLOW means the client
+ * didn't read the deltas fast enough and must subscribe again).
+ *
+ * Every change to the tree has a generation number, one more than the change
+ * before it. The reply to a query starts with JF_MSG_GENERATION, whose payload
+ * is the uint64 generation of the latest change when the query started.
+ * JF_MSG_CHANGES, whose payload is a uint64 generation, asks for every change
+ * since that generation; the daemon replies with JF_MSG_GENERATION, then any
+ * number of JF_MSG_CHANGES, then JF_MSG_DONE with the count of changes. Each
+ * change in a JF_MSG_CHANGES payload is a uint64 generation, a uint8 type
+ * (JF_CHANGE_*), a nul-terminated path, and for a rename a second
+ * nul-terminated path that it was renamed to. Applying the changes since the
+ * generation a query started at to its results brings them up to date. Only
+ * the latest changes are remembered, and if the generation asked for is older
+ * than those (or the daemon has reindexed since) the reply is JF_MSG_DONE
+ * with JF_STATUS_RESYNC, and the client must query again.
+ *
+ * A query with JF_OPT_BULK writes its results to a file instead of sending
+ * them in JF_MSG_RESULTS frames, which saves copying them through the socket
+ * when there are a lot of them. The client passes the file (a regular file,
+ * such as one from memfd_create()) as SCM_RIGHTS ancillary data on the bytes
+ * of the JF_MSG_QUERY frame (files are used by bulk queries in the order they
+ * are passed), and each result is written to it followed by the
+ * option's value rather than a nul byte, so that the file can be copied
+ * straight to the output. The results are all in the file by the time
+ * JF_MSG_DONE (or JF_MSG_SYNCED) arrives.
+ *
+ * Queries with JF_OPT_REFINE set make up a refinement session, for clients
+ * that search again as the user types. Each one replaces the one before it
+ * on the connection: if that is still running it is ended with JF_MSG_DONE
+ * and JF_STATUS_CANCELLED, and if it finished and the new term contains its
+ * term (with the same path and order), the new results are found by
+ * filtering its results instead of searching the tree again, as long as
+ * nothing under the path has changed since.
+ *
+ * JF_MSG_CANCEL, with an empty payload, stops the query (or subscription)
+ * with the same id: it is ended with JF_MSG_DONE and JF_STATUS_CANCELLED,
+ * unless it has already ended, in which case nothing more is sent. A
+ * cancellation is handled even while the client has as many queries in
+ * flight as it may have. Closing the connection cancels all of its queries.
+ *
+ * JF_MSG_STATS, with an empty payload, asks for the daemon's statistics: the
+ * daemon replies with a JF_MSG_STATS whose payload is text in the Prometheus
+ * exposition format, and then JF_MSG_DONE.
+ *
+ * The daemon shares itself out between the users connected to it (by uid)
+ * rather than between connections. Big searches may wait for others to
+ * finish before starting, and a search that runs for too long is ended with
+ * JF_MSG_DONE and JF_STATUS_LIMIT, carrying the count of results sent so far.
+ *
+ * James Stanley 2012
+ */
+
+#define JF_VERSION 1
+
+#define JF_HEADER_SIZE 12
+#define JF_MAX_FRAME (1 << 24)
+
+/* message types */
+#define JF_MSG_HELLO      1
+#define JF_MSG_QUERY      2
+#define JF_MSG_RESULTS    3
+#define JF_MSG_DONE       4
+#define JF_MSG_SYNCED     5
+#define JF_MSG_DELTA      6
+#define JF_MSG_CHANGES    7
+#define JF_MSG_GENERATION 8
+#define JF_MSG_CANCEL     9
+#define JF_MSG_STATS      10
+
+/* statuses */
+#define JF_STATUS_OK          0
+#define JF_STATUS_BAD_VERSION 1/* the daemon can't speak this version */
+#define JF_STATUS_BAD_REQUEST 2/* the message was malformed or unknown */
+#define JF_STATUS_NOT_FOUND   3/* the path to search under is not indexed */
+#define JF_STATUS_OVERFLOW    4/* too many deltas were waiting to be read */
+#define JF_STATUS_RESYNC      5/* the changes asked for are no longer known */
+#define JF_STATUS_IO_ERROR    6/* the results couldn't be written to the file */
+#define JF_STATUS_CANCELLED   7/* the query was cancelled or replaced */
+#define JF_STATUS_LIMIT       8/* the query ran for too long */
+
+/* query options */
+#define JF_OPT_TERM      1/* string to search for (required) */
+#define JF_OPT_PATH      2/* only search under this path (default "/") */
+#define JF_OPT_UNORDERED 3/* uint8: 1 to allow results in any order */
+#define JF_OPT_SUBSCRIBE 4/* uint8: 1 to keep sending changes to the results */
+#define JF_OPT_BULK      5/* uint8: write results to the passed file, each
+                             followed by this byte */
+#define JF_OPT_REFINE    6/* uint8: 1 if this query replaces the connection's
+                             last refining query (see above) */
+
+/* types of change */
+#define JF_CHANGE_CREATE 1
+#define JF_CHANGE_DELETE 2
+#define JF_CHANGE_RENAME 3
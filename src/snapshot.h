@@ -0,0 +1,26 @@
+/* Index snapshots for jfind
+ *
+ * With -m, jfindd publishes a snapshot of its index at SNAPSHOT_PATH whenever
+ * the index has changed, at most every SNAPSHOT_INTERVAL seconds, so that
+ * clients can search it themselves instead of asking the daemon. Each
+ * snapshot is written to a temporary file and then renamed over the last one,
+ * so a snapshot that a client has open never changes under it.
+ *
+ * The file is a SnapshotHeader followed by every path in the index in tree
+ * order, each terminated by a nul byte. The header is in the byte order of
+ * the machine.
+ *
+ * James Stanley 2012
+ */
+
+#define JF_SNAPSHOT_MAGIC   "jfsnap\0\0"
+#define JF_SNAPSHOT_VERSION 1
+
+typedef struct SnapshotHeader {
+    char magic[8];/* JF_SNAPSHOT_MAGIC */
+    uint32_t version;/* JF_SNAPSHOT_VERSION */
+    uint32_t unused;
+    uint64_t generation;/* the latest change when the snapshot was started */
+    uint64_t npaths;
+    uint64_t size;/* bytes of paths after the header */
+} SnapshotHeader;